@@ -12,11 +12,46 @@
 #include <algorithm>
 #include <array>
 #include <string.h>
+#include <strings.h>
 #include <iostream>
 #include <string>
 #include <stack>
 #include <list>
 #include <regex>
+#include <cmath>
+#include <map>
+#include <set>
+#include <unordered_set>
+#include <unordered_map>
+#include <fstream>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <deque>
+#include <chrono>
+#include <queue>
+#include <functional>
+#include <memory>
+#include <vector>
+#include <stdint.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <signal.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
 typedef enum {
 	NONE, SELECT, FROM, WHERE
@@ -33,9 +68,131 @@ struct query_state_t {
 	token_state_t previous_state;
 	bool select_triggered_query_state_change;
 };
+/**
+ * Signature of a SQL function as far as the parser is concerned: whether its
+ * arguments can reference columns at all.
+ */
+struct sql_function_t {
+	const char *name;
+	bool column_args;
+};
+/**
+ * Functions recognised by is_function_call(). The arguments of a function
+ * with column_args are parsed like any other part of the query, others have
+ * their argument list skipped.
+ */
+constexpr struct sql_function_t sql_function_list[] = { { "ABS", true }, {
+		"AVG", true }, { "CAST", true }, { "CEIL", true }, { "CEILING", true }, {
+		"CHAR_LENGTH", true }, { "COALESCE", true }, { "CONCAT", true }, {
+		"CONCAT_WS", true }, { "CONVERT", true }, { "COUNT", true }, {
+		"CURDATE", false }, { "CURRENT_DATE", false }, { "CURRENT_TIME", false },
+		{ "CURRENT_TIMESTAMP", false }, { "CURTIME", false }, { "DATE", true }, {
+				"DATEDIFF", true }, { "DATE_ADD", true }, { "DATE_FORMAT", true },
+		{ "DATE_SUB", true }, { "DAY", true }, { "FLOOR", true }, {
+				"FROM_UNIXTIME", true }, { "GREATEST", true }, { "GROUP_CONCAT",
+				true }, { "HOUR", true }, { "IF", true }, { "IFNULL", true }, {
+				"INSTR", true }, { "ISNULL", true }, { "LCASE", true }, { "LEAST",
+				true }, { "LEFT", true }, { "LENGTH", true }, { "LOCATE", true }, {
+				"LOWER", true }, { "LTRIM", true }, { "MAX", true }, { "MD5", true },
+		{ "MIN", true }, { "MOD", true }, { "MONTH", true }, { "NOW", false }, {
+				"NULLIF", true }, { "RAND", false }, { "REPEAT", true }, {
+				"REPLACE", true }, { "RIGHT", true }, { "ROUND", true }, { "RTRIM",
+				true }, { "SHA1", true }, { "SIGN", true }, { "SUBSTR", true }, {
+				"SUBSTRING", true }, { "SUBSTRING_INDEX", true }, { "SUM", true }, {
+				"TRIM", true }, { "TRUNCATE", true }, { "UCASE", true }, {
+				"UNIX_TIMESTAMP", true }, { "UPPER", true }, { "UUID", false }, {
+				"YEAR", true } };
+/**
+ * A predicate of form <table_name>.<col_name> = <literal> or
+ * <table_name>.<col_name> IN (<literal>, ...) found on a shard-key column.
+ * value_list holds one entry for '=' and every list element for IN.
+ */
+struct shard_key_predicate_t {
+	std::string tblcol_name;
+	std::list<std::string> value_list;
+};
+/**
+ * A parenthesised list of literals skipped as a unit, for e.g. the list of
+ * an IN (1,2,3) or the rows of a multi-row INSERT .. VALUES (1,'a'),(2,'b').
+ */
+struct literal_list_t {
+	unsigned int row_count;
+	unsigned int value_count;
+};
 struct TblColList {
 	std::list<std::string> mTblNameList;
 	std::list<std::string> mTblColNameList;
+	std::list<struct shard_key_predicate_t> mShardKeyPredList;
+	std::list<struct literal_list_t> mLiteralListList;
+	std::string mWatchlistMatch;
+};
+/**
+ * Which tables hold which columns, as loaded from a schema file by
+ * load_schema_catalog(). Used to resolve a column referenced without a table
+ * name when more than one table is in scope. It is never modified once
+ * loaded and is shared by all threads parsing queries.
+ */
+struct schema_catalog_t {
+	// <table_name>.<col_name> in upper case
+	std::unordered_set<std::string> tblcol_set;
+	// identifies the catalog contents, for e.g. to key cached results
+	uint64_t fingerprint;
+};
+/**
+ * Tables whose use is to be reported, see load_table_watchlist(). A bloom
+ * filter small enough to stay in cache rules out most names before the
+ * exact lookup. Never modified once loaded.
+ */
+#define WATCHLIST_BLOOM_BITS (1 << 16)
+#define WATCHLIST_BLOOM_HASHES 3
+struct table_watchlist_t {
+	std::vector<uint64_t> bloom;
+	// upper-cased table name or other name -> table name as listed
+	std::unordered_map<std::string, std::string> name_map;
+};
+/**
+ * Optional knobs for ProcessQuery(). A NULL options pointer gives the plain
+ * table/column extraction.
+ */
+struct parse_options_t {
+	/*
+	 * shard-key columns in <table_name>.<col_name> form, in upper case as
+	 * column names are not case sensitive. Predicates comparing them against
+	 * literals are recorded in mShardKeyPredList.
+	 */
+	std::list<std::string> shard_key_list;
+	/*
+	 * stop parsing as soon as every shard key has a predicate. Useful when
+	 * the caller only routes the query and does not need the full lists.
+	 */
+	bool stop_when_shard_keys_found;
+	// record row/value counts of skipped literal lists in mLiteralListList
+	bool report_literal_lists;
+	/*
+	 * queries of at least this many bytes are split at their top level UNIONs
+	 * and the parts parsed on parallel_threads threads. 0 turns it off.
+	 */
+	size_t parallel_min_length;
+	unsigned int parallel_threads;
+	// resolves unqualified columns in multi-table queries, may be NULL
+	const struct schema_catalog_t *catalog;
+	/*
+	 * if set, parsing stops at the first FROM/JOIN table on the watchlist,
+	 * reported in mWatchlistMatch, and queries which can not reference a
+	 * watched table are not parsed at all. Result lists are partial then.
+	 */
+	const struct table_watchlist_t *watchlist;
+};
+/**
+ * Records how a parse used the table_name/alias_name lookup table, so that
+ * parts of a query parsed separately can be checked against what a parse of
+ * the whole query would have resolved.
+ */
+struct alias_trace_t {
+	std::list<lookup_table_for_name_alias_t> lookup_table_list;
+	std::set<std::string> queried_alias_set;
+	// parse ended before the end of input, for e.g. on a malformed query
+	bool stopped_early;
 };
 
 /**
@@ -44,7 +201,7 @@ struct TblColList {
  * contain list of table_names encountered so far.After clearing the table_name_list
  * it is set to false again.
  */
-bool state_reset_needed = false;
+thread_local bool state_reset_needed = false;
 
 void toggle_state_reset() {
 	state_reset_needed = (state_reset_needed == true) ? false : true;
@@ -191,6 +348,13 @@ bool is_valid_tblcol_name(std::string &token) {
  * 			updated in the process.
  * @return Return the scanned token.
  */
+/*
+ * token_separators: get_next_token() buffers elements from input stream until
+ * one of them is encountered. Note that they themselves are tokens as well.
+ */
+const char token_separators[] = { ',', '+', '.', '-', '*', '\\', '=', '(',
+		')', '<', '>', ';', ':', '!', '\0' };
+
 std::string get_next_token(std::string *input, unsigned int* index) {
 	std::string token = "";
 	/*
@@ -203,12 +367,6 @@ std::string get_next_token(std::string *input, unsigned int* index) {
 	 * Note: No matter what we will always advance index such that it will point
 	 * to next character in the stream ahead of
 	 */
-	/*
-	 * token_separators: we buffer elements from input stream until one of
-	 * them is encountered. Note that they themselves are tokens as well.
-	 */
-	char token_separators[] = { ',', '+', '.', '-', '*', '\\', '=', '(', ')',
-			'<', '>', ';', ':', '!', '\0' };
 	int number_of_token_separators = strlen(token_separators);
 	//find tokens
 	for (; *index < (*input).length(); (*index)++) {
@@ -333,6 +491,14 @@ bool is_number(const std::string& s) {
 		++it;
 	return !s.empty() && it == s.end();
 }
+/**
+ * @brief Checks if get_next_token() ends a token before c: c is a blank or one
+ * 			of the token_separators. Anything else, tabs and newlines included,
+ * 			is kept in the token.
+ */
+bool is_token_separator(char c) {
+	return c == ' ' or (c != '\0' and strchr(token_separators, c) != NULL);
+}
 /**
  * @brief Skips tokens which will not form a column-name or a table name.
  * @param token The token which is to be validated.
@@ -462,6 +628,42 @@ void print_final_result(struct TblColList *res) {
 		std::cout << "[" << *it << "]" << " ";
 	}
 	std::cout << std::endl;
+	if (!res->mShardKeyPredList.empty()) {
+		std::cout << "Shard key predicates: ";
+		for (std::list<struct shard_key_predicate_t>::iterator it =
+				res->mShardKeyPredList.begin();
+				it != res->mShardKeyPredList.end(); it++) {
+			std::cout << "[" << it->tblcol_name;
+			if (it->value_list.size() == 1) {
+				std::cout << " = " << it->value_list.front();
+			} else {
+				std::cout << " IN (";
+				for (std::list<std::string>::iterator v = it->value_list.begin();
+						v != it->value_list.end(); v++) {
+					if (v != it->value_list.begin())
+						std::cout << ",";
+					std::cout << *v;
+				}
+				std::cout << ")";
+			}
+			std::cout << "]" << " ";
+		}
+		std::cout << std::endl;
+	}
+	if (res->mWatchlistMatch != "") {
+		std::cout << "Watchlist match: [" << res->mWatchlistMatch << "]"
+				<< std::endl;
+	}
+	if (!res->mLiteralListList.empty()) {
+		std::cout << "Literal lists: ";
+		for (std::list<struct literal_list_t>::iterator it =
+				res->mLiteralListList.begin();
+				it != res->mLiteralListList.end(); it++) {
+			std::cout << "[" << it->row_count << " row(s), " << it->value_count
+					<< " value(s)]" << " ";
+		}
+		std::cout << std::endl;
+	}
 }
 /**
  * @brief A wrapper routine for get_next_token(). Reads  next token from query
@@ -474,7 +676,6 @@ void print_final_result(struct TblColList *res) {
  */
 std::string get_next_valid_token(std::string *query, unsigned int* index) {
 	std::string current_token = get_next_token(query, index);
-	std::string tmp = "";
 	//check if this token is a valid one
 	while (!is_valid_token(current_token) and *index < query->length()) {
 		current_token = get_next_token(query, index);
@@ -488,44 +689,65 @@ std::string get_next_valid_token(std::string *query, unsigned int* index) {
 	if (current_token[0] == '`') {
 		sanitize_token(&current_token);
 	}
-	// if token is CONCAT then eat out everything until a ')' is found
-	if (convert_to_uppercase(current_token) == "CONCAT") {
-		current_token = get_next_token(query, index);
-		while (current_token != ")" and *index < query->length()) {
-			current_token = get_next_token(query, index);
-		}
-		if (*index < query->length()) {
-			//this is bad as even though closing ')' have been encountered
-			// we still need a valid token
-			return "";
-		}
-		/*
-		 * if we are here then current_token is ")" now read next_token
-		 * so far we have only eaten CONCAT block. it's not for sure that next
-		 * block is a valid one.
-		 * is this recursive block correct ?
-		 */
-		current_token = get_next_valid_token(query, index);
-	} else if (convert_to_uppercase(current_token) == "MAX") {
-		/*
-		 * MAx(coulmn_name) is a keyword that gives a column name in round
-		 * brackets.
-		 */
-		tmp = get_next_token(query, index); //must be a (
-		if (tmp != "(") {
-			std::cerr << "No '(' after MAX at pos: " << *index << std::endl;
-			return "";
+	return current_token;
+}
+/**
+ * @brief Checks if token is a known function followed by its argument list
+ * 			and if so moves past the opening '('.
+ *
+ * Function arguments are not special to the parser, for e.g. in
+ * .. where COALESCE(c.expires, c.created) > now()
+ * c.expires and c.created are columns like any other. So only the function
+ * name and its brackets are taken out of the stream and the arguments,
+ * nested calls included, are left to the regular token path in the same
+ * forward pass. For functions whose arguments can not name columns the
+ * whole argument list is skipped.
+ *
+ * @param query The query being processed.
+ * @param index The index just past token. Moved past the '(' if token is a
+ * 			function call with column arguments, past the matching ')' if it is
+ * 			one without.
+ * @param token The token just read.
+ * @return 1 if an argument list was opened, 0 if token is not a function call
+ * 			and -1 if the whole call was skipped.
+ */
+int is_function_call(std::string *query, unsigned int *index,
+		std::string &token) {
+	unsigned int pos = *index;
+	//cheap test first: most tokens are not followed by '('
+	while (pos < query->length() and (*query)[pos] == ' ')
+		pos++;
+	if (pos >= query->length() or (*query)[pos] != '(')
+		return 0;
+
+	for (unsigned int i = 0;
+			i < sizeof(sql_function_list) / sizeof(sql_function_list[0]);
+			i++) {
+		if (strcasecmp(token.c_str(), sql_function_list[i].name) != 0)
+			continue;
+		if (sql_function_list[i].column_args) {
+			*index = pos + 1;
+			return 1;
 		}
-		//now read the actual col name
-		current_token = get_next_token(query, index);
-		//bypass the closing ')'
-		tmp = get_next_token(query, index); //must be a (
-		if (tmp != ")") {
-			std::cerr << "No ')' after MAX at pos: " << *index << std::endl;
-			return "";
+		//skip up to the matching ')' keeping quoted strings whole
+		int depth = 0;
+		for (; pos < query->length(); pos++) {
+			char c = (*query)[pos];
+			if (c == '\'' or c == '"' or c == '`') {
+				std::string::size_type closing_quote = query->find(c, pos + 1);
+				if (closing_quote == std::string::npos)
+					break;
+				pos = closing_quote;
+			} else if (c == '(') {
+				depth++;
+			} else if (c == ')' and --depth == 0) {
+				break;
+			}
 		}
+		*index = std::min<unsigned int>(pos + 1, query->length());
+		return -1;
 	}
-	return current_token;
+	return 0;
 }
 /**
  * @brief If a desired token is not found in the stream then a caller
@@ -547,13 +769,522 @@ void pushback_token_to_stream(std::string *token, unsigned int *stream_index) {
 	*stream_index = *stream_index - (token->length());
 }
 /**
- * @brief The main routine which accepts a SQL query and returns a list of type
- * 			TblColList which will contain list of all table and column names
- * 			referenced in the given query.
+ * @brief Reads a literal value (a quoted string or a number) from the stream.
+ *
+ * get_next_valid_token() skips literals altogether, so shard-key extraction
+ * reads them with get_next_token() instead. Enclosing quotes are stripped
+ * from strings while a leading sign and a fractional part are folded into
+ * numbers (4.5 is scanned as '4' '.' '5').
+ *
+ * @param query The query from where the literal will be read.
+ * @param index The index in the query. Left untouched if no literal is found.
+ * @param literal Receives the literal without its enclosing quotes.
+ * @return true if a literal was read, false otherwise.
+ */
+bool read_literal_token(std::string *query, unsigned int *index,
+		std::string *literal) {
+	unsigned int saved_index = *index;
+	std::string token = get_next_token(query, index);
+	std::string sign = "";
+
+	if (token.length() >= 2 and (token[0] == '\'' or token[0] == '"')) {
+		*literal = token.substr(1, token.length() - 2);
+		return true;
+	}
+	if (token == "-" or token == "+") {
+		if (token == "-")
+			sign = "-";
+		token = get_next_token(query, index);
+	}
+	if (!is_number(token)) {
+		*index = saved_index;
+		return false;
+	}
+	*literal = sign + token;
+
+	saved_index = *index;
+	if (get_next_token(query, index) == ".") {
+		token = get_next_token(query, index);
+		if (is_number(token)) {
+			*literal = *literal + "." + token;
+			return true;
+		}
+	}
+	*index = saved_index;
+	return true;
+}
+/**
+ * @brief Scans characters that may appear between literals of a numeric list:
+ * 			digits, signs, decimal points, commas and blanks.
+ *
+ * Where SSE2 is available 16 characters are classified at once, so long runs
+ * like 1,2,3,... are passed over without looking at single tokens.
+ *
+ * @param buf The query buffer.
+ * @param len Length of buf.
+ * @param pos Position from where scanning starts.
+ * @param commas Incremented by the number of commas passed over.
+ * @param has_digit Set to true if any digit was passed over.
+ * @return Position of the first character not in the set, or len.
+ */
+size_t scan_literal_chars(const char *buf, size_t len, size_t pos,
+		unsigned int *commas, bool *has_digit) {
+#ifdef __SSE2__
+	const __m128i below_zero = _mm_set1_epi8('0' - 1);
+	const __m128i above_nine = _mm_set1_epi8('9' + 1);
+	while (pos + 16 <= len) {
+		__m128i chunk = _mm_loadu_si128((const __m128i *) (buf + pos));
+		__m128i digit = _mm_and_si128(_mm_cmpgt_epi8(chunk, below_zero),
+				_mm_cmplt_epi8(chunk, above_nine));
+		__m128i comma = _mm_cmpeq_epi8(chunk, _mm_set1_epi8(','));
+		__m128i other = _mm_or_si128(
+				_mm_or_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8(' ')),
+						_mm_cmpeq_epi8(chunk, _mm_set1_epi8('\t'))),
+				_mm_or_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8('.')),
+						_mm_or_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8('-')),
+								_mm_cmpeq_epi8(chunk, _mm_set1_epi8('+')))));
+		unsigned int allowed_mask = _mm_movemask_epi8(
+				_mm_or_si128(_mm_or_si128(digit, comma), other));
+		unsigned int digit_mask = _mm_movemask_epi8(digit);
+		unsigned int comma_mask = _mm_movemask_epi8(comma);
+
+		if (allowed_mask != 0xFFFF) {
+			//only count what lies before the first character not in the set
+			unsigned int n = __builtin_ctz(~allowed_mask);
+			unsigned int keep = (1u << n) - 1;
+			*commas += __builtin_popcount(comma_mask & keep);
+			if (digit_mask & keep)
+				*has_digit = true;
+			return pos + n;
+		}
+		*commas += __builtin_popcount(comma_mask);
+		if (digit_mask)
+			*has_digit = true;
+		pos += 16;
+	}
+#endif
+	for (; pos < len; pos++) {
+		char c = buf[pos];
+		if (isdigit(c)) {
+			*has_digit = true;
+		} else if (c == ',') {
+			(*commas)++;
+		} else if (c != ' ' and c != '\t' and c != '.' and c != '-'
+				and c != '+') {
+			break;
+		}
+	}
+	return pos;
+}
+/**
+ * @brief Skips a parenthesised list which holds nothing but literals.
+ *
+ * ORM batch loads and bulk inserts send lists like
+ * .. where id IN (1,2,3, ...)
+ * .. insert into t1 values (1,'a'),(2,'b'), ...
+ * with thousands of elements. None of them can name a table or a column, so
+ * rather than pulling every literal and comma through get_next_valid_token()
+ * the whole list is stepped over with scan_literal_chars() and memchr() for
+ * quoted strings. Rows following the first one as ',(' are skipped too.
+ *
+ * Lists holding anything else (a name, a nested '(' , a subquery) or no
+ * literal at all, for e.g. now(), are left to the regular token path.
+ *
+ * @param query The query being processed.
+ * @param index The index just past the opening '('. On success it is moved
+ * 			past the closing ')' of the last row skipped.
+ * @param list Receives the number of rows and values skipped.
+ * @return true if at least one row was skipped.
+ */
+bool skip_literal_list(std::string *query, unsigned int *index,
+		struct literal_list_t *list) {
+	const char *buf = query->data();
+	size_t len = query->length();
+	size_t pos = *index;
+	size_t end_of_rows = 0;
+
+	list->row_count = 0;
+	list->value_count = 0;
+	while (true) {
+		unsigned int commas = 0;
+		bool has_value = false;
+		char c;
+
+		while (true) {
+			pos = scan_literal_chars(buf, len, pos, &commas, &has_value);
+			if (pos >= len)
+				break;
+			c = buf[pos];
+			if (c != '\'' and c != '"')
+				break;
+			const char *closing_quote = (const char *) memchr(buf + pos + 1, c,
+					len - pos - 1);
+			if (closing_quote == NULL) {
+				pos = len;
+				break;
+			}
+			pos = closing_quote - buf + 1;
+			has_value = true;
+		}
+		if (pos >= len or buf[pos] != ')' or !has_value)
+			break;
+
+		list->row_count++;
+		list->value_count += commas + 1;
+		end_of_rows = ++pos;
+
+		//another row of a multi-row VALUES list ?
+		while (pos < len and buf[pos] == ' ')
+			pos++;
+		if (pos >= len or buf[pos] != ',')
+			break;
+		pos++;
+		while (pos < len and buf[pos] == ' ')
+			pos++;
+		if (pos >= len or buf[pos] != '(')
+			break;
+		pos++;
+	}
+	if (list->row_count == 0)
+		return false;
+	*index = end_of_rows;
+	return true;
+}
+/**
+ * @brief Checks if a resolved <table_name>.<col_name> is a configured shard key.
+ * @param opts The parse options, may be NULL.
+ * @param tblcol_name The column name to look up.
+ * @return true if tblcol_name is one of the shard keys.
+ */
+bool is_shard_key(const struct parse_options_t *opts,
+		std::string &tblcol_name) {
+	if (opts == NULL)
+		return false;
+	return std::find(opts->shard_key_list.begin(), opts->shard_key_list.end(),
+			convert_to_uppercase(tblcol_name)) != opts->shard_key_list.end();
+}
+/**
+ * @brief Checks if every configured shard key has at least one predicate.
+ * @param opts The parse options.
+ * @param res The results gathered so far.
+ * @return true if nothing is left to find.
+ */
+bool all_shard_keys_found(const struct parse_options_t *opts,
+		struct TblColList *res) {
+	for (std::list<std::string>::const_iterator key =
+			opts->shard_key_list.begin(); key != opts->shard_key_list.end();
+			key++) {
+		bool found = false;
+		for (std::list<struct shard_key_predicate_t>::iterator it =
+				res->mShardKeyPredList.begin();
+				it != res->mShardKeyPredList.end(); it++) {
+			if (convert_to_uppercase(it->tblcol_name) == *key) {
+				found = true;
+				break;
+			}
+		}
+		if (!found)
+			return false;
+	}
+	return true;
+}
+/**
+ * @brief Records an equality or IN-list predicate on a shard-key column.
+ *
+ * Handles the two forms a router can act upon:
+ * .. where t1.user_id = 42
+ * .. where t1.user_id IN (1, 2, '3')
+ * Anything else, for e.g. a comparison against another column or a subquery
+ * inside IN, is not recorded.
+ *
+ * @param query The query being processed.
+ * @param index The index just past operator_token. It is restored to this
+ * 			position if no predicate could be read.
+ * @param tblcol_name The resolved <table_name>.<col_name> of the shard key.
+ * @param operator_token The token that followed the column.
+ * @param opts The parse options. The list of an IN is also recorded in
+ * 			mLiteralListList if they ask for literal lists, as it does not
+ * 			reach skip_literal_list() then.
+ * @param res The result structure where the predicate will be stored.
+ * @return true if a predicate was recorded.
+ */
+bool extract_shard_key_predicate(std::string *query, unsigned int *index,
+		std::string &tblcol_name, std::string &operator_token,
+		const struct parse_options_t *opts, struct TblColList *res) {
+	unsigned int saved_index = *index;
+	struct shard_key_predicate_t pred;
+	std::string literal, token;
+
+	pred.tblcol_name = tblcol_name;
+	if (operator_token == "=") {
+		if (!read_literal_token(query, index, &literal))
+			return false;
+		pred.value_list.push_back(literal);
+	} else if (convert_to_uppercase(operator_token) == "IN") {
+		if (get_next_token(query, index) != "(") {
+			*index = saved_index;
+			return false;
+		}
+		while (true) {
+			if (!read_literal_token(query, index, &literal)) {
+				*index = saved_index;
+				return false;
+			}
+			pred.value_list.push_back(literal);
+			token = get_next_token(query, index);
+			if (token == ")")
+				break;
+			if (token != ",") {
+				*index = saved_index;
+				return false;
+			}
+		}
+		if (opts->report_literal_lists) {
+			struct literal_list_t literal_list;
+			literal_list.row_count = 1;
+			literal_list.value_count = pred.value_list.size();
+			res->mLiteralListList.push_back(literal_list);
+		}
+	} else {
+		return false;
+	}
+	res->mShardKeyPredList.push_back(pred);
+	return true;
+}
+/**
+ * @brief Hashes data into a running 64 bit FNV-1a value.
+ */
+uint64_t fnv1a_64(uint64_t hash, const char *data, size_t len) {
+	for (size_t i = 0; i < len; i++) {
+		hash ^= (unsigned char) data[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+/**
+ * @brief Loads a schema file into a catalog.
+ *
+ * Every line names a table followed by one or more of its columns, separated
+ * by blanks or commas, which covers both a tab separated dump of
+ * information_schema.columns (one column per line) and one line per table:
+ * coupon	couponId
+ * user userId,photo,preferredUsername
+ * Empty lines and lines beginning with '#' are skipped.
+ *
+ * @param path The schema file.
+ * @param catalog The catalog to be filled.
+ * @return false if the file could not be read.
+ */
+bool load_schema_catalog(std::string path, struct schema_catalog_t *catalog) {
+	std::ifstream schema_file(path.c_str());
+	std::string line, table_name;
+	const char *separators = " \t,\r";
+
+	if (!schema_file.is_open())
+		return false;
+	catalog->tblcol_set.clear();
+	catalog->fingerprint = 14695981039346656037ULL;
+	while (getline(schema_file, line)) {
+		catalog->fingerprint = fnv1a_64(catalog->fingerprint, line.data(),
+				line.length() + 1);
+		std::string::size_type start = line.find_first_not_of(separators);
+		if (start == std::string::npos or line[start] == '#')
+			continue;
+		std::string::size_type end = line.find_first_of(separators, start);
+		table_name = convert_to_uppercase(line.substr(start, end - start));
+		while (end != std::string::npos) {
+			start = line.find_first_not_of(separators, end);
+			if (start == std::string::npos)
+				break;
+			end = line.find_first_of(separators, start);
+			catalog->tblcol_set.insert(
+					table_name + "."
+							+ convert_to_uppercase(
+									line.substr(start, end - start)));
+		}
+	}
+	return !schema_file.bad();
+}
+/**
+ * @brief Looks up which of the tables in scope holds an unqualified column.
+ * @param opts The parse options, may be NULL or have no catalog.
+ * @param table_name_list Tables of the current query state.
+ * @param col_name The column referenced without a table name.
+ * @param table_name Receives the table, if exactly one of them has col_name.
+ * @return true if the column could be resolved.
+ */
+bool resolve_column_table(const struct parse_options_t *opts,
+		std::list<std::string> &table_name_list, std::string &col_name,
+		std::string *table_name) {
+	int matches = 0;
+	if (opts == NULL or opts->catalog == NULL)
+		return false;
+
+	std::string col_in_cap = "." + convert_to_uppercase(col_name);
+	for (std::list<std::string>::iterator it = table_name_list.begin();
+			it != table_name_list.end(); it++) {
+		if (opts->catalog->tblcol_set.count(
+				convert_to_uppercase(*it) + col_in_cap) != 0) {
+			*table_name = *it;
+			matches++;
+		}
+	}
+	return matches == 1;
+}
+/**
+ * @brief Hashes a table name for the watchlist, ignoring case.
+ */
+uint64_t watchlist_hash(const char *name, size_t len) {
+	uint64_t hash = 14695981039346656037ULL;
+	for (size_t i = 0; i < len; i++) {
+		hash ^= (unsigned char) toupper((unsigned char) name[i]);
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+/**
+ * @brief Bit positions of a name hash in the bloom filter, by double hashing.
+ */
+inline uint64_t watchlist_bloom_bit(uint64_t hash, unsigned int i) {
+	return ((hash & 0xFFFFFFFF) + i * (hash >> 32)) & (WATCHLIST_BLOOM_BITS - 1);
+}
+/**
+ * @brief Checks the bloom filter. false means the name is surely not watched.
+ */
+inline bool watchlist_may_contain(const struct table_watchlist_t *watchlist,
+		uint64_t hash) {
+	for (unsigned int i = 0; i < WATCHLIST_BLOOM_HASHES; i++) {
+		uint64_t bit = watchlist_bloom_bit(hash, i);
+		if ((watchlist->bloom[bit / 64] & (1ULL << (bit % 64))) == 0)
+			return false;
+	}
+	return true;
+}
+/**
+ * @brief Loads a table watchlist.
+ *
+ * Every line names a watched table, optionally followed by other names the
+ * same table goes by, separated by blanks or commas:
+ * payment_card
+ * customer_pii customer_pii_v2 pii
+ * Matching ignores case. Empty lines and lines beginning with '#' are
+ * skipped.
+ *
+ * @param path The watchlist file.
+ * @param watchlist The watchlist to be filled.
+ * @return false if the file could not be read.
+ */
+bool load_table_watchlist(std::string path,
+		struct table_watchlist_t *watchlist) {
+	std::ifstream watchlist_file(path.c_str());
+	std::string line, table_name, name;
+	const char *separators = " \t,\r";
+
+	if (!watchlist_file.is_open())
+		return false;
+	watchlist->bloom.assign(WATCHLIST_BLOOM_BITS / 64, 0);
+	watchlist->name_map.clear();
+	while (getline(watchlist_file, line)) {
+		std::string::size_type start = line.find_first_not_of(separators);
+		if (start == std::string::npos or line[start] == '#')
+			continue;
+		table_name = "";
+		while (start != std::string::npos) {
+			std::string::size_type end = line.find_first_of(separators, start);
+			name = line.substr(start, end - start);
+			if (table_name == "")
+				table_name = name;
+			watchlist->name_map[convert_to_uppercase(name)] = table_name;
+			uint64_t hash = watchlist_hash(name.data(), name.length());
+			for (unsigned int i = 0; i < WATCHLIST_BLOOM_HASHES; i++) {
+				uint64_t bit = watchlist_bloom_bit(hash, i);
+				watchlist->bloom[bit / 64] |= 1ULL << (bit % 64);
+			}
+			start = line.find_first_not_of(separators, end);
+		}
+	}
+	return !watchlist_file.bad();
+}
+/**
+ * @brief Checks if a table name read in FROM/JOIN is on the watchlist.
+ * @param watchlist The watchlist.
+ * @param name The table name.
+ * @param table_name Receives the watched table, as listed first on its line.
+ * @return true on a confirmed match.
+ */
+bool watchlist_lookup(const struct table_watchlist_t *watchlist,
+		std::string &name, std::string *table_name) {
+	if (!watchlist_may_contain(watchlist,
+			watchlist_hash(name.data(), name.length())))
+		return false;
+	std::unordered_map<std::string, std::string>::const_iterator it =
+			watchlist->name_map.find(convert_to_uppercase(name));
+	if (it == watchlist->name_map.end())
+		return false;
+	*table_name = it->second;
+	return true;
+}
+/**
+ * @brief Tells if a query can possibly reference a watched table.
+ *
+ * Runs every token get_next_token() would return, but for quoted strings,
+ * through the bloom filter, without building any of them. Tokens are split
+ * exactly where the lexer splits them, for a name cut short here could miss
+ * a watched table. Queries where no token passes can not match and need not
+ * be parsed at all.
+ *
+ * @param watchlist The watchlist.
+ * @param query The query.
+ * @return false if the query surely does not touch a watched table.
+ */
+bool query_may_touch_watchlist(const struct table_watchlist_t *watchlist,
+		std::string &query) {
+	const char *buf = query.data();
+	size_t len = query.length();
+
+	for (size_t i = 0; i < len; i++) {
+		char c = buf[i];
+		if (is_token_separator(c)) {
+			continue;
+		} else if (c == '\'' or c == '"' or c == '`') {
+			const char *closing_quote = (const char *) memchr(buf + i + 1, c,
+					len - i - 1);
+			size_t end = (closing_quote == NULL) ? len : closing_quote - buf;
+			// strings are never names, quoted names lose their backticks
+			if (c == '`'
+					and watchlist_may_contain(watchlist,
+							watchlist_hash(buf + i + 1, end - i - 1)))
+				return true;
+			i = end;
+		} else {
+			size_t end = i;
+			while (end < len and !is_token_separator(buf[end])
+					and buf[end] != '\'' and buf[end] != '"'
+					and buf[end] != '`')
+				end++;
+			// a quote inside a token is kept in it, up to the closing quote
+			if (end < len and !is_token_separator(buf[end])) {
+				const char *closing_quote = (const char *) memchr(
+						buf + end + 1, buf[end], len - end - 1);
+				end = (closing_quote == NULL) ? len : closing_quote - buf + 1;
+			}
+			if (watchlist_may_contain(watchlist,
+					watchlist_hash(buf + i, end - i)))
+				return true;
+			i = end - 1;
+		}
+	}
+	return false;
+}
+/**
+ * @brief Parses a query, or a part of it, on the calling thread.
  * @param queryStr The query which is to be looked into.
+ * @param opts Optional parse options, NULL for plain extraction.
+ * @param trace If not NULL, receives the alias lookups done by the parse.
  * @return A list of results.
  */
-struct TblColList* ProcessQuery(std::string queryStr) {
+struct TblColList* parse_query(std::string queryStr,
+		const struct parse_options_t *opts, struct alias_trace_t *trace) {
 	std::string current_token, previous_token, next_token;
 	unsigned int index = 0;
 	std::list<std::string> table_name_list; //store list of tables in current state
@@ -561,8 +1292,11 @@ struct TblColList* ProcessQuery(std::string queryStr) {
 	token_state_t current_state = NONE, previous_state = NONE;
 	std::string table_name, col_name;
 
-	std::list<lookup_table_for_name_alias_t> lookup_table_list;
+	std::list<lookup_table_for_name_alias_t> own_lookup_table_list;
+	std::list<lookup_table_for_name_alias_t> &lookup_table_list =
+			(trace != NULL) ? trace->lookup_table_list : own_lookup_table_list;
 	lookup_table_for_name_alias_t lookup_element;
+	struct literal_list_t literal_list;
 
 	/*
 	 * we will use stack where we will save the table_name_list the moment
@@ -576,6 +1310,11 @@ struct TblColList* ProcessQuery(std::string queryStr) {
 	 */
 	struct query_state_t query_state;
 	std::stack<struct query_state_t> query_state_stack;
+	/*
+	 * one entry per '(' still open, true if it opened the argument list of
+	 * a function call. The matching ')' then only closes the call.
+	 */
+	std::stack<bool> function_paren_stack;
 
 	struct TblColList *pRes = new TblColList;
 
@@ -587,10 +1326,30 @@ struct TblColList* ProcessQuery(std::string queryStr) {
 		//have we reached end of stream
 		if (current_token == "") {
 			//no matter what we must end processing. How could we get an empty token ?
+			if (trace != NULL)
+				trace->stopped_early = (index < queryStr.length());
 			return pRes;
 		}
 
+		switch (is_function_call(&queryStr, &index, current_token)) {
+		case 1:
+			function_paren_stack.push(true);
+			continue;
+		case -1:
+			continue;
+		default:
+			break;
+		}
+
 		if (current_token == "(") {
+			// literal-only lists can not hold names, step over them at once
+			if (skip_literal_list(&queryStr, &index, &literal_list)) {
+				if (opts != NULL and opts->report_literal_lists) {
+					pRes->mLiteralListList.push_back(literal_list);
+				}
+				continue;
+			}
+			function_paren_stack.push(false);
 			/*
 			 * when a opening '(' is encountered in the stream, it will not
 			 * necessarily mean beginning of a sub-query. It can involve expressions
@@ -644,6 +1403,12 @@ struct TblColList* ProcessQuery(std::string queryStr) {
 			continue;
 		}
 		if (current_token == ")") {
+			if (!function_paren_stack.empty()) {
+				bool closes_function = function_paren_stack.top();
+				function_paren_stack.pop();
+				if (closes_function)
+					continue;
+			}
 			//now time to pop back what we stored in stack
 			if (query_state_stack.empty()) {
 				continue;
@@ -722,6 +1487,11 @@ struct TblColList* ProcessQuery(std::string queryStr) {
 				pushback_token_to_stream(&current_token, &index);
 				continue;
 			}
+			if (opts != NULL and opts->watchlist != NULL
+					and watchlist_lookup(opts->watchlist, current_token,
+							&pRes->mWatchlistMatch)) {
+				return pRes;
+			}
 
 			next_token = "";
 			next_token = get_next_valid_token(&queryStr, &index);
@@ -755,6 +1525,8 @@ struct TblColList* ProcessQuery(std::string queryStr) {
 					std::cerr
 							<< "Expected a valid <column_name> after AS before : "
 							<< next_token << std::endl;
+					if (trace != NULL)
+						trace->stopped_early = true;
 					return pRes;
 				}
 				//save the table_name and col_names
@@ -793,6 +1565,8 @@ struct TblColList* ProcessQuery(std::string queryStr) {
 					//thats bad
 					std::cerr << "Expected valid token after '.' near " << index
 							<< std::endl;
+					if (trace != NULL)
+						trace->stopped_early = true;
 					return pRes;
 				}
 				/*
@@ -802,6 +1576,8 @@ struct TblColList* ProcessQuery(std::string queryStr) {
 				 */
 
 				//current_token could be alias so lets get its table name
+				if (trace != NULL)
+					trace->queried_alias_set.insert(current_token);
 				table_name = find_table_name_of_alias_tblname(lookup_table_list,
 						current_token);
 				if (!is_valid_tblcol_name(table_name)) {
@@ -811,6 +1587,17 @@ struct TblColList* ProcessQuery(std::string queryStr) {
 					store_table_name_uniquely(pRes->mTblNameList, table_name);
 					std::string tmp = table_name + "." + next_token;
 					store_table_col_name_uniquely(pRes->mTblColNameList, tmp);
+
+					if (is_shard_key(opts, tmp)) {
+						next_token = get_next_token(&queryStr, &index);
+						if (!extract_shard_key_predicate(&queryStr, &index, tmp,
+								next_token, opts, pRes)) {
+							pushback_token_to_stream(&next_token, &index);
+						} else if (opts->stop_when_shard_keys_found
+								and all_shard_keys_found(opts, pRes)) {
+							return pRes;
+						}
+					}
 				}
 			} else {
 				/*
@@ -831,15 +1618,28 @@ struct TblColList* ProcessQuery(std::string queryStr) {
 				 * For single table case: all cols will be considered as referenced. However for
 				 * multi-table non-composite columns , we will list them without any relationship.
 				 */
-				if (table_name_list.size() == 1) {
+				if (table_name_list.size() == 1
+						or resolve_column_table(opts, table_name_list,
+								current_token, &table_name)) {
 					/*
 					 * case where we have single table name but may have
-					 * mutliple cols.
+					 * mutliple cols. With a schema catalog the same holds for
+					 * a column which only one of the tables has.
 					 */
-					table_name = table_name_list.front();
+					if (table_name_list.size() == 1)
+						table_name = table_name_list.front();
 					store_table_name_uniquely(pRes->mTblNameList, table_name);
 					std::string tmp = table_name + "." + current_token;
 					store_table_col_name_uniquely(pRes->mTblColNameList, tmp);
+
+					// next_token already holds the operator following the column
+					if (is_shard_key(opts, tmp)
+							and extract_shard_key_predicate(&queryStr, &index,
+									tmp, next_token, opts, pRes)
+							and opts->stop_when_shard_keys_found
+							and all_shard_keys_found(opts, pRes)) {
+						return pRes;
+					}
 				} else {
 					/*
 					 * case where we have more than one tables --
@@ -859,17 +1659,1812 @@ struct TblColList* ProcessQuery(std::string queryStr) {
 	}
 	return pRes;
 }
-int main(int argc, char *argv[]) {
-	std::string query;
-	struct TblColList *res = NULL;
-	while (!std::cin.eof()) {
-		getline(std::cin, query);
-		if (query == "")
-			continue;
-		std::cout << "Parsing query: " << query << "\n" << std::endl;
-		res = ProcessQuery(query);
-		print_final_result(res);
-		std::cout << std::endl;
+/**
+ * @brief Checks for keyword at pos in query, in any case, as a token of its
+ * 			own the way get_next_token() splits them. A token begins after a
+ * 			separator or a closing quote and ends before a separator.
+ */
+bool is_keyword_at(const std::string &query, size_t pos, const char *keyword) {
+	size_t len = strlen(keyword);
+	if (pos + len > query.length())
+		return false;
+	if (pos > 0 and !is_token_separator(query[pos - 1])
+			and query[pos - 1] != '\'' and query[pos - 1] != '"'
+			and query[pos - 1] != '`')
+		return false;
+	if (pos + len < query.length() and !is_token_separator(query[pos + len]))
+		return false;
+	return strncasecmp(query.data() + pos, keyword, len) == 0;
+}
+/**
+ * @brief Skips blanks in query starting at pos. Only ' ' is a blank to
+ * 			get_next_token(), tabs and newlines are part of tokens.
+ * @return Position of the first non blank character or query length.
+ */
+size_t skip_blanks(const std::string &query, size_t pos) {
+	while (pos < query.length() and query[pos] == ' ')
+		pos++;
+	return pos;
+}
+/**
+ * @brief Checks that the first token ProcessQuery() acts upon after a
+ * 			UNION .. SELECT clears table_name_list.
+ *
+ * The reset requested by UNION/SELECT only happens on the first token that
+ * is neither skipped by get_next_valid_token() (quoted strings, numbers) nor
+ * handled ahead of it: a '(' , a function call or a state changing keyword.
+ * If one of those comes first the previous part's tables are still in scope,
+ * for e.g. saved on query_state_stack by
+ * .. UNION SELECT 5 FROM (SELECT ..) d
+ * and the part does not parse the same on its own.
+ *
+ * @param query The query being scanned.
+ * @param pos Position just past SELECT and the blanks after it.
+ * @return true if the part starting at this UNION may be parsed on its own.
+ */
+bool resets_state_at(const std::string &query, size_t pos) {
+	const char *buf = query.data();
+	size_t len = query.length();
+	const char *state_keywords[] = { "FROM", "JOIN", "WHERE", "ON", "BY" };
+
+	if (is_keyword_at(query, pos, "ALL")) {
+		pos = skip_blanks(query, pos + 3);
+	} else if (is_keyword_at(query, pos, "DISTINCT")) {
+		pos = skip_blanks(query, pos + 8);
+	}
+	//literals are skipped by get_next_valid_token()
+	while (pos < len) {
+		if (buf[pos] == '\'' or buf[pos] == '"') {
+			const char *closing_quote = (const char *) memchr(buf + pos + 1,
+					buf[pos], len - pos - 1);
+			if (closing_quote == NULL)
+				return false;
+			pos = closing_quote - buf + 1;
+		} else if (isdigit((unsigned char) buf[pos])) {
+			size_t end = pos;
+			while (end < len and isdigit((unsigned char) buf[end]))
+				end++;
+			// 12abc is a name to get_next_token()
+			if (end < len and !is_token_separator(buf[end]))
+				break;
+			pos = end;
+		} else {
+			break;
+		}
+		pos = skip_blanks(query, pos);
+	}
+	if (pos >= len or buf[pos] == '(')
+		return false;
+	for (unsigned int k = 0; k < 5; k++) {
+		if (is_keyword_at(query, pos, state_keywords[k]))
+			return false;
+	}
+	size_t word_end = pos;
+	while (word_end < len and !is_token_separator(buf[word_end])
+			and buf[word_end] != '\'' and buf[word_end] != '"'
+			and buf[word_end] != '`')
+		word_end++;
+	word_end = skip_blanks(query, word_end);
+	return word_end >= len or buf[word_end] != '(';
+}
+/**
+ * @brief Finds the UNIONs at which a query can be split into parts that
+ * 			parse the same on their own as within the whole query.
+ *
+ * A single character pass which follows quotes and backticks the way
+ * get_next_token() does and tracks round bracket depth. Only UNIONs at depth 0
+ * qualify: there query_state_stack is empty and the UNION resets
+ * table_name_list. Forms where the reset would be delayed are left alone:
+ * .. UNION (SELECT ..)
+ * .. UNION SELECT (SELECT ..) ..
+ * .. UNION SELECT COUNT((SELECT ..)) ..
+ * .. UNION SELECT 5 FROM (SELECT ..) ..
+ * see resets_state_at().
+ *
+ * @param query The query to be scanned.
+ * @param boundaries Receives the position of every qualifying UNION.
+ * @return false if brackets do not balance, in which case nothing is split.
+ */
+bool find_union_boundaries(const std::string &query,
+		std::vector<size_t> *boundaries) {
+	const char *buf = query.data();
+	size_t len = query.length();
+	int depth = 0;
+
+	for (size_t i = 0; i < len; i++) {
+		char c = buf[i];
+		if (c == '\'' or c == '"' or c == '`') {
+			const char *closing_quote = (const char *) memchr(buf + i + 1, c,
+					len - i - 1);
+			if (closing_quote == NULL)
+				break;
+			i = closing_quote - buf;
+		} else if (c == '(') {
+			depth++;
+		} else if (c == ')') {
+			if (--depth < 0)
+				return false;
+		} else if (depth == 0 and (c == 'u' or c == 'U')
+				and is_keyword_at(query, i, "UNION")) {
+			size_t pos = skip_blanks(query, i + 5);
+			if (is_keyword_at(query, pos, "ALL")) {
+				pos = skip_blanks(query, pos + 3);
+			} else if (is_keyword_at(query, pos, "DISTINCT")) {
+				pos = skip_blanks(query, pos + 8);
+			}
+			if (is_keyword_at(query, pos, "SELECT")
+					and resets_state_at(query, skip_blanks(query, pos + 6))) {
+				boundaries->push_back(i);
+			}
+			i += 4;
+		}
+	}
+	return depth == 0;
+}
+/**
+ * State of one parse_query_parallel() call, shared with the pool threads
+ * helping it. Chunks are claimed through next_chunk; everything else is only
+ * touched after a successful claim, while the caller is still waiting, so a
+ * helper starting after the last chunk was claimed just drops its reference.
+ */
+struct parallel_parse_job_t {
+	const std::string *query;
+	const struct parse_options_t *opts;
+	std::vector<size_t> chunk_start; // chunk_count + 1 entries
+	size_t chunk_count;
+	std::vector<struct TblColList *> chunk_res;
+	std::vector<struct alias_trace_t> traces;
+	std::atomic<size_t> next_chunk;
+	size_t done_count;
+	std::mutex lock;
+	std::condition_variable all_done;
+};
+/*
+ * Threads helping parse_query_parallel(). Started once, on first use, with
+ * parallel_threads - 1 threads, the caller being the last one. They are
+ * shared by every caller, daemon workers included, so large queries parsed
+ * at the same time do not each start threads of their own.
+ */
+struct parse_pool_t {
+	std::mutex lock;
+	std::condition_variable not_empty;
+	std::deque<std::shared_ptr<struct parallel_parse_job_t> > job_list;
+};
+/*
+ * never freed: its threads may still be waiting on it while the process
+ * exits, and destroying a condition_variable with waiters blocks.
+ */
+struct parse_pool_t *parse_pool = NULL;
+std::once_flag parse_pool_started;
+
+/**
+ * @brief Parses chunks of a job until none is left unclaimed.
+ */
+void run_parallel_parse_job(struct parallel_parse_job_t *job) {
+	size_t i;
+	while ((i = job->next_chunk++) < job->chunk_count) {
+		job->traces[i].stopped_early = false;
+		job->chunk_res[i] = parse_query(
+				job->query->substr(job->chunk_start[i],
+						job->chunk_start[i + 1] - job->chunk_start[i]),
+				job->opts, &job->traces[i]);
+
+		std::lock_guard<std::mutex> guard(job->lock);
+		if (++job->done_count == job->chunk_count)
+			job->all_done.notify_all();
+	}
+}
+/**
+ * @brief Pool thread loop: helps with whatever job was queued.
+ */
+void parse_pool_worker() {
+	while (true) {
+		std::shared_ptr<struct parallel_parse_job_t> job;
+		{
+			std::unique_lock<std::mutex> guard(parse_pool->lock);
+			while (parse_pool->job_list.empty())
+				parse_pool->not_empty.wait(guard);
+			job = parse_pool->job_list.front();
+			parse_pool->job_list.pop_front();
+		}
+		run_parallel_parse_job(job.get());
+	}
+}
+/**
+ * @brief Starts the pool threads, once.
+ */
+void start_parse_pool(unsigned int thread_count) {
+	parse_pool = new parse_pool_t;
+	for (unsigned int t = 0; t < thread_count; t++) {
+		std::thread(parse_pool_worker).detach();
+	}
+}
+/**
+ * @brief Parses a long query with its top level UNION parts spread across
+ * 			threads and merges the results in query order.
+ *
+ * Parts are grouped into chunks of about equal size, a few per thread, and
+ * each chunk is parsed by parse_query(), on the calling thread and on the
+ * shared parse_pool threads. The lookup table of aliases is not
+ * reset by UNION, so a later part may resolve an alias declared by an earlier
+ * one. Every chunk records the aliases it looked up; if any of them was
+ * declared in an earlier chunk the whole query is parsed again sequentially.
+ *
+ * @param queryStr The query which is to be looked into.
+ * @param opts Parse options, parallel_threads must be set.
+ * @return A list of results, the same as parse_query() would give.
+ */
+struct TblColList* parse_query_parallel(std::string &queryStr,
+		const struct parse_options_t *opts) {
+	std::vector<size_t> boundaries;
+	std::shared_ptr<struct parallel_parse_job_t> job(
+			new parallel_parse_job_t);
+	std::vector<size_t> &chunk_start = job->chunk_start;
+	size_t chunk_count, target_size;
+
+	if (!find_union_boundaries(queryStr, &boundaries) or boundaries.empty())
+		return parse_query(queryStr, opts, NULL);
+
+	chunk_count = std::min<size_t>(boundaries.size() + 1,
+			(size_t) opts->parallel_threads * 4);
+	target_size = queryStr.length() / chunk_count;
+	chunk_start.push_back(0);
+	for (size_t i = 0; i < boundaries.size(); i++) {
+		if (boundaries[i] - chunk_start.back() >= target_size)
+			chunk_start.push_back(boundaries[i]);
+	}
+	chunk_count = chunk_start.size();
+	chunk_start.push_back(queryStr.length());
+
+	job->query = &queryStr;
+	job->opts = opts;
+	job->chunk_count = chunk_count;
+	job->chunk_res.assign(chunk_count, NULL);
+	job->traces.resize(chunk_count);
+	job->next_chunk = 0;
+	job->done_count = 0;
+	std::vector<struct TblColList *> &chunk_res = job->chunk_res;
+	std::vector<struct alias_trace_t> &traces = job->traces;
+
+	std::call_once(parse_pool_started, start_parse_pool,
+			opts->parallel_threads - 1);
+	{
+		std::lock_guard<std::mutex> guard(parse_pool->lock);
+		for (unsigned int t = 1; t < opts->parallel_threads and t < chunk_count;
+				t++) {
+			parse_pool->job_list.push_back(job);
+		}
+		parse_pool->not_empty.notify_all();
+	}
+	run_parallel_parse_job(job.get());
+	{
+		std::unique_lock<std::mutex> guard(job->lock);
+		while (job->done_count < chunk_count)
+			job->all_done.wait(guard);
+	}
+
+	//would any chunk have resolved an alias declared before it ?
+	bool conflict = false;
+	std::set<std::string> declared_alias_set;
+	for (size_t i = 0; i < chunk_count and !conflict; i++) {
+		for (std::set<std::string>::iterator it =
+				traces[i].queried_alias_set.begin();
+				it != traces[i].queried_alias_set.end(); it++) {
+			if (declared_alias_set.count(*it) != 0) {
+				conflict = true;
+				break;
+			}
+		}
+		for (std::list<lookup_table_for_name_alias_t>::iterator it =
+				traces[i].lookup_table_list.begin();
+				it != traces[i].lookup_table_list.end(); it++) {
+			declared_alias_set.insert(it->alias_name);
+		}
+		if (traces[i].stopped_early)
+			break;
+	}
+
+	struct TblColList *pRes = NULL;
+	if (conflict) {
+		pRes = parse_query(queryStr, opts, NULL);
+	} else {
+		pRes = new TblColList;
+		for (size_t i = 0; i < chunk_count; i++) {
+			struct TblColList *res = chunk_res[i];
+			for (std::list<std::string>::iterator it = res->mTblNameList.begin();
+					it != res->mTblNameList.end(); it++) {
+				store_table_name_uniquely(pRes->mTblNameList, *it);
+			}
+			for (std::list<std::string>::iterator it =
+					res->mTblColNameList.begin();
+					it != res->mTblColNameList.end(); it++) {
+				store_table_col_name_uniquely(pRes->mTblColNameList, *it);
+			}
+			pRes->mShardKeyPredList.splice(pRes->mShardKeyPredList.end(),
+					res->mShardKeyPredList);
+			pRes->mLiteralListList.splice(pRes->mLiteralListList.end(),
+					res->mLiteralListList);
+			if (traces[i].stopped_early)
+				break;
+		}
+	}
+	for (size_t i = 0; i < chunk_count; i++) {
+		delete chunk_res[i];
+	}
+	return pRes;
+}
+/*
+ * ===================== latency report =====================
+ *
+ * With --latency-report every ProcessQuery() call is timed. Times go into a
+ * log-linear (HDR style) histogram with LATENCY_SUB_BUCKET_BITS bits of
+ * precision per power of two, about 3%, and the slowest queries are kept in
+ * a bounded min-heap. Each thread records into its own latency_stats_t; the
+ * report merges all of them.
+ *
+ * The clock is the time stamp counter where there is one, calibrated against
+ * std::chrono::steady_clock over the whole run when the report is printed.
+ */
+#define LATENCY_SUB_BUCKET_BITS 5
+#define LATENCY_BUCKET_COUNT \
+	((64 - LATENCY_SUB_BUCKET_BITS + 1) << LATENCY_SUB_BUCKET_BITS)
+
+struct slow_query_t {
+	uint64_t ticks;
+	unsigned int token_count;
+	std::string query;
+	bool operator>(const struct slow_query_t &other) const {
+		return ticks > other.ticks;
+	}
+};
+struct latency_stats_t {
+	std::mutex lock; // only contended while a report is being merged
+	std::vector<uint64_t> bucket_list;
+	uint64_t count;
+	uint64_t max_ticks;
+	std::priority_queue<struct slow_query_t, std::vector<struct slow_query_t>,
+			std::greater<struct slow_query_t> > slowest_heap;
+};
+
+/*
+ * set once by enable_latency_report() before any parsing thread starts
+ */
+bool latency_report_enabled = false;
+unsigned int latency_slowest_count = 0;
+uint64_t latency_clock_start = 0;
+std::chrono::steady_clock::time_point latency_steady_start;
+
+std::mutex latency_registry_lock;
+std::list<struct latency_stats_t *> latency_registry;
+thread_local struct latency_stats_t *thread_latency_stats = NULL;
+
+/**
+ * @brief Reads the latency clock, in ticks.
+ */
+inline uint64_t read_latency_clock() {
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+/**
+ * @brief Turns on timing of ProcessQuery() calls.
+ * @param slowest_count How many of the slowest queries are to be kept.
+ */
+void enable_latency_report(unsigned int slowest_count) {
+	latency_report_enabled = true;
+	latency_slowest_count = slowest_count;
+	latency_steady_start = std::chrono::steady_clock::now();
+	latency_clock_start = read_latency_clock();
+}
+/**
+ * @brief Maps a tick count to its histogram bucket.
+ */
+unsigned int latency_bucket_index(uint64_t ticks) {
+	if (ticks < (1u << LATENCY_SUB_BUCKET_BITS))
+		return ticks;
+	unsigned int shift = 63 - __builtin_clzll(ticks) - LATENCY_SUB_BUCKET_BITS;
+	return ((shift + 1) << LATENCY_SUB_BUCKET_BITS)
+			| ((ticks >> shift) & ((1u << LATENCY_SUB_BUCKET_BITS) - 1));
+}
+/**
+ * @brief Gives the lowest tick count falling in a histogram bucket.
+ */
+uint64_t latency_bucket_value(unsigned int index) {
+	if (index < (1u << LATENCY_SUB_BUCKET_BITS))
+		return index;
+	unsigned int shift = (index >> LATENCY_SUB_BUCKET_BITS) - 1;
+	uint64_t mantissa = (index & ((1u << LATENCY_SUB_BUCKET_BITS) - 1))
+			| (1u << LATENCY_SUB_BUCKET_BITS);
+	return mantissa << shift;
+}
+/**
+ * @brief Counts the tokens of a query the way ProcessQuery() reads them.
+ */
+unsigned int count_tokens(std::string &query) {
+	unsigned int index = 0, token_count = 0;
+	while (index < query.length()) {
+		if (get_next_token(&query, &index) != "")
+			token_count++;
+	}
+	return token_count;
+}
+/**
+ * @brief Records the time taken by one query on the calling thread.
+ */
+void record_query_latency(std::string &query, uint64_t ticks) {
+	struct latency_stats_t *stats = thread_latency_stats;
+	if (stats == NULL) {
+		stats = new latency_stats_t;
+		stats->bucket_list.assign(LATENCY_BUCKET_COUNT, 0);
+		stats->count = 0;
+		stats->max_ticks = 0;
+		std::lock_guard<std::mutex> guard(latency_registry_lock);
+		latency_registry.push_back(stats);
+		thread_latency_stats = stats;
+	}
+
+	std::lock_guard<std::mutex> guard(stats->lock);
+	stats->bucket_list[latency_bucket_index(ticks)]++;
+	stats->count++;
+	stats->max_ticks = std::max(stats->max_ticks, ticks);
+	//the query text is only copied when it makes it into the heap
+	if (latency_slowest_count != 0
+			and (stats->slowest_heap.size() < latency_slowest_count
+					or ticks > stats->slowest_heap.top().ticks)) {
+		struct slow_query_t slow_query;
+		slow_query.ticks = ticks;
+		slow_query.token_count = count_tokens(query);
+		slow_query.query = query;
+		stats->slowest_heap.push(slow_query);
+		if (stats->slowest_heap.size() > latency_slowest_count)
+			stats->slowest_heap.pop();
+	}
+}
+/**
+ * @brief Merges the statistics of all threads and prints the percentiles
+ * 			and the slowest queries.
+ */
+void print_latency_report() {
+	std::vector<uint64_t> bucket_list(LATENCY_BUCKET_COUNT, 0);
+	std::vector<struct slow_query_t> slowest_list;
+	uint64_t count = 0, max_ticks = 0;
+
+	{
+		std::lock_guard<std::mutex> registry_guard(latency_registry_lock);
+		for (std::list<struct latency_stats_t *>::iterator it =
+				latency_registry.begin(); it != latency_registry.end(); it++) {
+			std::lock_guard<std::mutex> guard((*it)->lock);
+			for (unsigned int i = 0; i < LATENCY_BUCKET_COUNT; i++) {
+				bucket_list[i] += (*it)->bucket_list[i];
+			}
+			count += (*it)->count;
+			max_ticks = std::max(max_ticks, (*it)->max_ticks);
+			//copy, the thread may go on recording
+			std::priority_queue<struct slow_query_t,
+					std::vector<struct slow_query_t>,
+					std::greater<struct slow_query_t> > heap =
+					(*it)->slowest_heap;
+			while (!heap.empty()) {
+				slowest_list.push_back(heap.top());
+				heap.pop();
+			}
+		}
+	}
+
+	double elapsed_ns = std::chrono::duration<double, std::nano>(
+			std::chrono::steady_clock::now() - latency_steady_start).count();
+	uint64_t elapsed_ticks = read_latency_clock() - latency_clock_start;
+	double ns_per_tick = (elapsed_ticks == 0) ? 1 : elapsed_ns / elapsed_ticks;
+
+	std::cout << "Latency report: " << count << " queries" << std::endl;
+	if (count == 0)
+		return;
+	const double percentiles[] = { 50, 90, 99, 99.9 };
+	std::cout << "Latency (us):";
+	for (unsigned int p = 0; p < 4; p++) {
+		uint64_t rank = (uint64_t) (percentiles[p] / 100 * count), seen = 0;
+		unsigned int i = 0;
+		for (; i < LATENCY_BUCKET_COUNT; i++) {
+			seen += bucket_list[i];
+			if (seen > rank)
+				break;
+		}
+		uint64_t ticks = (i < LATENCY_BUCKET_COUNT) ?
+				std::min(latency_bucket_value(i), max_ticks) : max_ticks;
+		std::cout << " p" << percentiles[p] << "="
+				<< ticks * ns_per_tick / 1000;
+	}
+	std::cout << " max=" << max_ticks * ns_per_tick / 1000 << std::endl;
+
+	std::sort(slowest_list.begin(), slowest_list.end(),
+			std::greater<struct slow_query_t>());
+	if (slowest_list.size() > latency_slowest_count)
+		slowest_list.resize(latency_slowest_count);
+	for (size_t i = 0; i < slowest_list.size(); i++) {
+		std::cout << "Slow query " << (i + 1) << ": "
+				<< slowest_list[i].ticks * ns_per_tick / 1000 << " us, "
+				<< slowest_list[i].token_count << " tokens: "
+				<< slowest_list[i].query << std::endl;
+	}
+}
+/**
+ * @brief The main routine which accepts a SQL query and returns a list of type
+ * 			TblColList which will contain list of all table and column names
+ * 			referenced in the given query.
+ * @param queryStr The query which is to be looked into.
+ * @param opts Optional parse options, NULL for plain extraction.
+ * @return A list of results.
+ */
+struct TblColList* ProcessQuery(std::string queryStr,
+		const struct parse_options_t *opts = NULL) {
+	struct TblColList *pRes = NULL;
+	uint64_t start = latency_report_enabled ? read_latency_clock() : 0;
+	/*
+	 * an early stop on shard keys or watched tables must see the parts in
+	 * order, so such parses are never split.
+	 */
+	if (opts != NULL and opts->watchlist != NULL
+			and !query_may_touch_watchlist(opts->watchlist, queryStr)) {
+		pRes = new TblColList;
+	} else if (opts != NULL and opts->parallel_min_length != 0
+			and opts->parallel_threads > 1
+			and queryStr.length() >= opts->parallel_min_length
+			and !opts->stop_when_shard_keys_found
+			and opts->watchlist == NULL) {
+		pRes = parse_query_parallel(queryStr, opts);
+	} else {
+		pRes = parse_query(queryStr, opts, NULL);
+	}
+	if (latency_report_enabled) {
+		record_query_latency(queryStr, read_latency_clock() - start);
+	}
+	return pRes;
+}
+/*
+ * ===================== persistent result cache =====================
+ *
+ * Query shapes repeat a lot while literals differ, and the parser never
+ * looks at literals. So results are keyed by a digest of the query with its
+ * literals and blank runs normalized, and kept in a file which survives
+ * restarts:
+ *
+ * [result_cache_header_t][slot_count x result_cache_slot_t][data]
+ *
+ * slots form an open addressing (linear probing) table on the digest, each
+ * pointing to a serialized TblColList in the data area. The file is mapped
+ * read-only and shared, so any number of processes can look it up at once.
+ * Results parsed while running are kept aside and merged into a fresh file
+ * by result_cache_save() which then replaces the old one with rename(). It
+ * runs every RESULT_CACHE_SAVE_INTERVAL seconds, on SIGINT/SIGTERM and at
+ * exit. Processes sharing a cache file take turns through an flock() on
+ * <path>.lock and each merges in the file as it is at that time, so no one
+ * drops what another one saved.
+ *
+ * Integers are stored in host byte order; the file is meant for the host
+ * that wrote it. It is rejected unless it was written by this very build of
+ * the parser.
+ */
+#define RESULT_CACHE_MAGIC "QPCACHE"
+#define RESULT_CACHE_FORMAT_VERSION 1
+#define RESULT_CACHE_SAVE_INTERVAL 60
+
+struct result_cache_header_t {
+	char magic[8];
+	uint32_t format_version;
+	uint32_t reserved;
+	uint64_t build_id;
+	uint64_t slot_count;
+	uint64_t data_offset;
+};
+struct result_cache_slot_t {
+	uint64_t digest; // 0 marks an empty slot
+	uint32_t offset; // relative to data_offset
+	uint32_t length;
+};
+struct result_cache_t {
+	std::string path;
+	const char *map; // NULL when no usable cache file was found
+	size_t map_size;
+	const struct result_cache_header_t *header;
+	const struct result_cache_slot_t *slots;
+	std::map<uint64_t, std::string> pending; // parsed since the last save
+	std::chrono::steady_clock::time_point last_save;
+	// guards all of the above, the cache may be shared by several threads
+	std::mutex lock;
+};
+
+/**
+ * @brief Identifies this build of the parser. Cache files written by any
+ * 			other build are ignored.
+ */
+uint64_t parser_build_id() {
+	const char build[] = __DATE__ " " __TIME__;
+	uint64_t id = fnv1a_64(14695981039346656037ULL, build, sizeof(build));
+	return id ^ RESULT_CACHE_FORMAT_VERSION;
+}
+/**
+ * @brief Computes the normalized digest of a query.
+ *
+ * Two queries get the same digest when they only differ in their literals
+ * or the length of blank runs, for e.g.
+ * select a from t1 where t1.id = 5 and t1.name = 'x'
+ * select a from t1   where t1.id = 77 and t1.name = "yz"
+ * Only what get_next_token() can not tell apart is folded: quoted strings and
+ * runs of digits which are tokens of their own, and runs of ' '. Names, tabs
+ * and backtick quoted names are hashed as they are, since they show up in
+ * the results.
+ *
+ * @param query The query to be hashed.
+ * @param seed Starting hash value. Results depending on more than the query
+ * 			text, for e.g. on a schema catalog, use a seed derived from it.
+ * @return The digest, never 0.
+ */
+uint64_t compute_query_digest(const std::string &query, uint64_t seed) {
+	uint64_t hash = seed;
+	const char *buf = query.data();
+	size_t len = query.length();
+	const char literal = '?', blank = ' ';
+	bool blank_pending = false;
+	// the next character begins a token, see get_next_token()
+	bool token_start = true;
+
+	for (size_t i = 0; i < len; i++) {
+		char c = buf[i];
+		if (c == ' ') {
+			blank_pending = true;
+			token_start = true;
+			continue;
+		}
+		if (blank_pending) {
+			hash = fnv1a_64(hash, &blank, 1);
+			blank_pending = false;
+		}
+		if (c == '\'' or c == '"' or c == '`') {
+			const char *closing_quote = (const char *) memchr(buf + i + 1, c,
+					len - i - 1);
+			size_t end = (closing_quote == NULL) ? len : closing_quote - buf + 1;
+			// a string beginning a token is a literal, anything else a name
+			if (c != '`' and token_start) {
+				hash = fnv1a_64(hash, &literal, 1);
+			} else {
+				hash = fnv1a_64(hash, buf + i, end - i);
+			}
+			i = end - 1;
+			token_start = true;
+			continue;
+		}
+		if (token_start and isdigit((unsigned char) c)) {
+			size_t end = i;
+			while (end < len and isdigit((unsigned char) buf[end]))
+				end++;
+			// 12abc is not a number and is left alone
+			if (end == len or is_token_separator(buf[end])) {
+				i = end - 1;
+				hash = fnv1a_64(hash, &literal, 1);
+				token_start = false;
+				continue;
+			}
+		}
+		hash = fnv1a_64(hash, &c, 1);
+		token_start = is_token_separator(c);
+	}
+	return (hash == 0) ? 1 : hash;
+}
+/**
+ * @brief Appends a length prefixed list of strings to buf.
+ */
+void serialize_list(std::list<std::string> &mylist, std::string *buf) {
+	uint32_t n = mylist.size();
+	buf->append((const char *) &n, sizeof(n));
+	for (std::list<std::string>::iterator it = mylist.begin();
+			it != mylist.end(); it++) {
+		n = it->length();
+		buf->append((const char *) &n, sizeof(n));
+		buf->append(*it);
+	}
+}
+/**
+ * @brief Reads back a list written by serialize_list().
+ * @param data Start of the serialized list.
+ * @param len Bytes available at data.
+ * @param mylist Receives the strings.
+ * @return Bytes consumed, 0 if the data is malformed.
+ */
+size_t deserialize_list(const char *data, size_t len,
+		std::list<std::string> &mylist) {
+	uint32_t count, n;
+	size_t pos = sizeof(count);
+	if (len < pos)
+		return 0;
+	memcpy(&count, data, sizeof(count));
+	for (uint32_t i = 0; i < count; i++) {
+		if (len - pos < sizeof(n))
+			return 0;
+		memcpy(&n, data + pos, sizeof(n));
+		pos += sizeof(n);
+		if (len - pos < n)
+			return 0;
+		mylist.push_back(std::string(data + pos, n));
+		pos += n;
+	}
+	return pos;
+}
+/**
+ * @brief Serializes the table and column lists of a result.
+ */
+void serialize_result(struct TblColList *res, std::string *buf) {
+	buf->clear();
+	serialize_list(res->mTblNameList, buf);
+	serialize_list(res->mTblColNameList, buf);
+}
+/**
+ * @brief Builds a result from data written by serialize_result().
+ * @return The result or NULL if the data is malformed.
+ */
+struct TblColList* deserialize_result(const char *data, size_t len) {
+	struct TblColList *res = new TblColList;
+	size_t used = deserialize_list(data, len, res->mTblNameList);
+	if (used == 0
+			or deserialize_list(data + used, len - used, res->mTblColNameList)
+					== 0) {
+		delete res;
+		return NULL;
+	}
+	return res;
+}
+/**
+ * @brief Maps the cache file at cache->path, if there is a valid one.
+ *
+ * A missing, truncated or foreign cache file is not an error: the cache
+ * just starts out empty and will be rewritten by result_cache_save().
+ */
+void result_cache_map(struct result_cache_t *cache) {
+	struct stat st;
+	int fd;
+	void *map;
+	const std::string &path = cache->path;
+
+	cache->map = NULL;
+	cache->map_size = 0;
+	cache->header = NULL;
+	cache->slots = NULL;
+
+	fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		return;
+	if (fstat(fd, &st) != 0
+			or (size_t) st.st_size < sizeof(struct result_cache_header_t)) {
+		close(fd);
+		return;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return;
+
+	const struct result_cache_header_t *header =
+			(const struct result_cache_header_t *) map;
+	uint64_t slot_count = header->slot_count;
+	if (memcmp(header->magic, RESULT_CACHE_MAGIC, sizeof(header->magic)) != 0
+			or header->format_version != RESULT_CACHE_FORMAT_VERSION
+			or header->build_id != parser_build_id() or slot_count == 0
+			or (slot_count & (slot_count - 1)) != 0
+			or slot_count > (uint64_t) st.st_size
+			or header->data_offset
+					!= sizeof(*header)
+							+ slot_count * sizeof(struct result_cache_slot_t)
+			or header->data_offset > (uint64_t) st.st_size) {
+		std::cerr << "Ignoring stale or invalid result cache: " << path
+				<< std::endl;
+		munmap(map, st.st_size);
+		return;
+	}
+	cache->map = (const char *) map;
+	cache->map_size = st.st_size;
+	cache->header = header;
+	cache->slots = (const struct result_cache_slot_t *) (cache->map
+			+ sizeof(*header));
+}
+/**
+ * @brief Unmaps the cache file, if one is mapped.
+ */
+void result_cache_unmap(struct result_cache_t *cache) {
+	if (cache->map != NULL) {
+		munmap((void *) cache->map, cache->map_size);
+	}
+	cache->map = NULL;
+	cache->header = NULL;
+	cache->slots = NULL;
+}
+/**
+ * @brief Maps the cache file at path, if there is a valid one.
+ * @param cache The cache to be initialised.
+ * @param path The cache file.
+ */
+void result_cache_open(struct result_cache_t *cache, std::string path) {
+	cache->path = path;
+	cache->pending.clear();
+	cache->last_save = std::chrono::steady_clock::now();
+	result_cache_map(cache);
+}
+/**
+ * @brief Looks up a result by query digest.
+ * @return A freshly allocated result or NULL on a miss.
+ */
+struct TblColList* result_cache_lookup(struct result_cache_t *cache,
+		uint64_t digest) {
+	std::lock_guard<std::mutex> guard(cache->lock);
+	if (cache->map != NULL) {
+		uint64_t mask = cache->header->slot_count - 1;
+		size_t data_size = cache->map_size - cache->header->data_offset;
+		for (uint64_t i = digest & mask;; i = (i + 1) & mask) {
+			const struct result_cache_slot_t *slot = &cache->slots[i];
+			if (slot->digest == 0)
+				break;
+			if (slot->digest == digest) {
+				if ((size_t) slot->offset + slot->length > data_size)
+					return NULL;
+				return deserialize_result(
+						cache->map + cache->header->data_offset + slot->offset,
+						slot->length);
+			}
+		}
+	}
+	std::map<uint64_t, std::string>::iterator it = cache->pending.find(digest);
+	if (it != cache->pending.end()) {
+		return deserialize_result(it->second.data(), it->second.length());
+	}
+	return NULL;
+}
+/**
+ * @brief Writes the entries of the cache file along with the pending ones to
+ * 			a new cache file and moves it in place of the old one.
+ *
+ * The file is re-read under an exclusive flock() on <path>.lock first, so
+ * that entries saved by other processes since it was mapped are kept. The
+ * new file is mapped in place of the old one and the pending entries are
+ * dropped.
+ *
+ * @param cache The cache, its lock held by the caller.
+ * @return true on success.
+ */
+bool result_cache_save_locked(struct result_cache_t *cache) {
+	std::vector<struct result_cache_slot_t> slots;
+	std::string data;
+	struct result_cache_header_t header;
+	uint64_t slot_count = 16, entry_count = cache->pending.size();
+	uint64_t mask;
+
+	cache->last_save = std::chrono::steady_clock::now();
+	if (entry_count == 0)
+		return true;
+
+	std::string lock_path = cache->path + ".lock";
+	int lock_fd = open(lock_path.c_str(), O_RDWR | O_CREAT, 0644);
+	if (lock_fd < 0) {
+		std::cerr << "Could not lock result cache: " << lock_path << ": "
+				<< strerror(errno) << std::endl;
+		return false;
+	}
+	while (flock(lock_fd, LOCK_EX) != 0 and errno == EINTR)
+		;
+	result_cache_unmap(cache);
+	result_cache_map(cache);
+
+	if (cache->map != NULL) {
+		for (uint64_t i = 0; i < cache->header->slot_count; i++) {
+			if (cache->slots[i].digest != 0)
+				entry_count++;
+		}
+	}
+	while (slot_count < 2 * entry_count)
+		slot_count *= 2;
+	mask = slot_count - 1;
+	slots.assign(slot_count, result_cache_slot_t());
+
+	// pending entries first, the mapped ones skip digests already placed
+	std::map<uint64_t, std::string> entries = cache->pending;
+	if (cache->map != NULL) {
+		const char *old_data = cache->map + cache->header->data_offset;
+		size_t old_data_size = cache->map_size - cache->header->data_offset;
+		for (uint64_t i = 0; i < cache->header->slot_count; i++) {
+			const struct result_cache_slot_t *slot = &cache->slots[i];
+			if (slot->digest != 0
+					and (size_t) slot->offset + slot->length <= old_data_size) {
+				entries.insert(
+						std::make_pair(slot->digest,
+								std::string(old_data + slot->offset,
+										slot->length)));
+			}
+		}
+	}
+	for (std::map<uint64_t, std::string>::iterator it = entries.begin();
+			it != entries.end(); it++) {
+		uint64_t i = it->first & mask;
+		while (slots[i].digest != 0)
+			i = (i + 1) & mask;
+		if (data.length() + it->second.length() > UINT32_MAX) {
+			std::cerr << "Result cache too large, not saved" << std::endl;
+			close(lock_fd);
+			return false;
+		}
+		slots[i].digest = it->first;
+		slots[i].offset = data.length();
+		slots[i].length = it->second.length();
+		data.append(it->second);
+	}
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, RESULT_CACHE_MAGIC, sizeof(header.magic));
+	header.format_version = RESULT_CACHE_FORMAT_VERSION;
+	header.build_id = parser_build_id();
+	header.slot_count = slot_count;
+	header.data_offset = sizeof(header)
+			+ slot_count * sizeof(struct result_cache_slot_t);
+
+	/*
+	 * write a private file and rename it over the old one so that readers
+	 * never see a partially written cache.
+	 */
+	std::string tmp_path = cache->path + ".tmp." + std::to_string(getpid());
+	FILE *fp = fopen(tmp_path.c_str(), "wb");
+	if (fp == NULL) {
+		std::cerr << "Could not write result cache: " << tmp_path << std::endl;
+		close(lock_fd);
+		return false;
+	}
+	bool ok = fwrite(&header, sizeof(header), 1, fp) == 1
+			and fwrite(&slots[0], sizeof(struct result_cache_slot_t),
+					slot_count, fp) == slot_count
+			and (data.empty() or fwrite(data.data(), data.length(), 1, fp) == 1);
+	ok = (fclose(fp) == 0) and ok;
+	if (!ok or rename(tmp_path.c_str(), cache->path.c_str()) != 0) {
+		std::cerr << "Could not write result cache: " << cache->path
+				<< std::endl;
+		unlink(tmp_path.c_str());
+		close(lock_fd);
+		return false;
+	}
+	result_cache_unmap(cache);
+	result_cache_map(cache);
+	cache->pending.clear();
+	close(lock_fd);
+	return true;
+}
+/**
+ * @brief Saves the cache, see result_cache_save_locked().
+ * @return true on success.
+ */
+bool result_cache_save(struct result_cache_t *cache) {
+	std::lock_guard<std::mutex> guard(cache->lock);
+	return result_cache_save_locked(cache);
+}
+/**
+ * @brief Remembers a freshly parsed result, to be written out by
+ * 			result_cache_save(). Saves the cache if the last save was
+ * 			RESULT_CACHE_SAVE_INTERVAL seconds ago.
+ */
+void result_cache_add(struct result_cache_t *cache, uint64_t digest,
+		struct TblColList *res) {
+	std::lock_guard<std::mutex> guard(cache->lock);
+	serialize_result(res, &cache->pending[digest]);
+	if (std::chrono::steady_clock::now() - cache->last_save
+			>= std::chrono::seconds(RESULT_CACHE_SAVE_INTERVAL)) {
+		result_cache_save_locked(cache);
+	}
+}
+/**
+ * @brief Unmaps the cache file and drops pending results.
+ */
+void result_cache_close(struct result_cache_t *cache) {
+	std::lock_guard<std::mutex> guard(cache->lock);
+	result_cache_unmap(cache);
+	cache->pending.clear();
+}
+/**
+ * @brief Waits for SIGINT/SIGTERM, then saves the cache and exits, so that a
+ * 			worker stopped before the end of its input keeps what it parsed.
+ */
+void result_cache_wait_for_shutdown(sigset_t signal_set,
+		struct result_cache_t *cache) {
+	int sig;
+	while (sigwait(&signal_set, &sig) != 0)
+		;
+	result_cache_save(cache);
+	std::cout.flush();
+	_exit(128 + sig);
+}
+/*
+ * ===================== daemon mode =====================
+ *
+ * Instead of one process per batch of queries the parser can stay up and
+ * serve queries over a unix domain socket. Every message is length prefixed
+ * with 32 bit integers in host byte order:
+ *
+ * request:  [query_count] query_count x ([length][query bytes])
+ * response: [status] [result_count] result_count x ([length][result])
+ *
+ * where a result is a TblColList as written by serialize_daemon_result().
+ * status is one of daemon_status_t; on an error no results follow.
+ *
+ * Each connection gets a thread which reads batches and hands them to a
+ * bounded queue served by a pool of parsing workers. A full queue blocks the
+ * connection threads, which in turn stop reading from their clients.
+ */
+#define DAEMON_MAX_QUERY_LENGTH (64 * 1024 * 1024)
+
+typedef enum {
+	DAEMON_OK, DAEMON_BATCH_TOO_LARGE
+} daemon_status_t;
+
+struct daemon_job_t {
+	std::vector<std::string> query_list;
+	std::promise<std::string> response;
+};
+struct daemon_config_t {
+	std::string socket_path;
+	unsigned int worker_count;
+	unsigned int max_batch_size;
+	unsigned int queue_depth;
+	const struct parse_options_t *opts;
+	// looked up before parsing and saved on shutdown, may be NULL
+	struct result_cache_t *cache;
+	uint64_t digest_seed;
+};
+struct daemon_queue_t {
+	std::deque<struct daemon_job_t *> job_list;
+	std::mutex lock;
+	std::condition_variable not_empty;
+	std::condition_variable not_full;
+	unsigned int depth;
+};
+
+/**
+ * @brief Reads exactly len bytes from fd.
+ * @return false on error or end of file.
+ */
+bool read_full(int fd, void *buf, size_t len) {
+	char *p = (char *) buf;
+	while (len > 0) {
+		ssize_t n = read(fd, p, len);
+		if (n < 0 and errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		p += n;
+		len -= n;
+	}
+	return true;
+}
+/**
+ * @brief Writes exactly len bytes to fd.
+ * @return false on error.
+ */
+bool write_full(int fd, const void *buf, size_t len) {
+	const char *p = (const char *) buf;
+	while (len > 0) {
+		ssize_t n = write(fd, p, len);
+		if (n < 0 and errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		p += n;
+		len -= n;
+	}
+	return true;
+}
+/**
+ * @brief Appends a 32 bit integer to buf.
+ */
+void append_uint32(std::string *buf, uint32_t n) {
+	buf->append((const char *) &n, sizeof(n));
+}
+/**
+ * @brief Serializes a result for a daemon client: the table and column lists
+ * as serialize_result() writes them, followed by
+ *
+ * [predicate_count] predicate_count x ([length][tblcol_name] [value list])
+ * [literal_list_count] literal_list_count x ([row_count][value_count])
+ * [length][watchlist match]
+ *
+ * where the value list is written by serialize_list() and the watchlist
+ * match is empty unless a watched table was found.
+ */
+void serialize_daemon_result(struct TblColList *res, std::string *buf) {
+	serialize_result(res, buf);
+	append_uint32(buf, res->mShardKeyPredList.size());
+	for (std::list<struct shard_key_predicate_t>::iterator it =
+			res->mShardKeyPredList.begin(); it != res->mShardKeyPredList.end();
+			it++) {
+		append_uint32(buf, it->tblcol_name.length());
+		buf->append(it->tblcol_name);
+		serialize_list(it->value_list, buf);
+	}
+	append_uint32(buf, res->mLiteralListList.size());
+	for (std::list<struct literal_list_t>::iterator it =
+			res->mLiteralListList.begin(); it != res->mLiteralListList.end();
+			it++) {
+		append_uint32(buf, it->row_count);
+		append_uint32(buf, it->value_count);
+	}
+	append_uint32(buf, res->mWatchlistMatch.length());
+	buf->append(res->mWatchlistMatch);
+}
+/**
+ * @brief Queues a job, waiting while the queue is full.
+ */
+void daemon_queue_push(struct daemon_queue_t *queue, struct daemon_job_t *job) {
+	std::unique_lock<std::mutex> guard(queue->lock);
+	while (queue->job_list.size() >= queue->depth)
+		queue->not_full.wait(guard);
+	queue->job_list.push_back(job);
+	queue->not_empty.notify_one();
+}
+/**
+ * @brief Takes the oldest job off the queue, waiting while it is empty.
+ */
+struct daemon_job_t* daemon_queue_pop(struct daemon_queue_t *queue) {
+	std::unique_lock<std::mutex> guard(queue->lock);
+	while (queue->job_list.empty())
+		queue->not_empty.wait(guard);
+	struct daemon_job_t *job = queue->job_list.front();
+	queue->job_list.pop_front();
+	queue->not_full.notify_one();
+	return job;
+}
+/**
+ * @brief Worker loop: parses every query of a batch and builds the response.
+ */
+void daemon_worker(struct daemon_queue_t *queue,
+		const struct daemon_config_t *config) {
+	std::string response, result;
+	while (true) {
+		struct daemon_job_t *job = daemon_queue_pop(queue);
+		response.clear();
+		append_uint32(&response, DAEMON_OK);
+		append_uint32(&response, job->query_list.size());
+		for (size_t i = 0; i < job->query_list.size(); i++) {
+			struct TblColList *res = NULL;
+			if (config->cache != NULL) {
+				uint64_t digest = compute_query_digest(job->query_list[i],
+						config->digest_seed);
+				res = result_cache_lookup(config->cache, digest);
+				if (res == NULL) {
+					res = ProcessQuery(job->query_list[i], config->opts);
+					result_cache_add(config->cache, digest, res);
+				}
+			} else {
+				res = ProcessQuery(job->query_list[i], config->opts);
+			}
+			serialize_daemon_result(res, &result);
+			delete res;
+			append_uint32(&response, result.length());
+			response.append(result);
+		}
+		job->response.set_value(response);
+	}
+}
+/**
+ * @brief Serves one client connection until it is closed.
+ */
+void daemon_serve_connection(int fd, struct daemon_queue_t *queue,
+		const struct daemon_config_t *config) {
+	uint32_t query_count, len;
+	std::string response;
+
+	while (read_full(fd, &query_count, sizeof(query_count))) {
+		struct daemon_job_t job;
+		bool ok = true;
+
+		job.query_list.reserve(
+				std::min<uint32_t>(query_count, config->max_batch_size));
+		for (uint32_t i = 0; i < query_count and ok; i++) {
+			ok = read_full(fd, &len, sizeof(len))
+					and len <= DAEMON_MAX_QUERY_LENGTH;
+			if (!ok)
+				break;
+			std::string query(len, '\0');
+			ok = (len == 0) or read_full(fd, &query[0], len);
+			//an oversized batch is still read through to keep the stream in sync
+			if (i < config->max_batch_size)
+				job.query_list.push_back(query);
+		}
+		if (!ok)
+			break;
+
+		if (query_count > config->max_batch_size) {
+			response.clear();
+			append_uint32(&response, DAEMON_BATCH_TOO_LARGE);
+			append_uint32(&response, 0);
+		} else {
+			std::future<std::string> done = job.response.get_future();
+			daemon_queue_push(queue, &job);
+			response = done.get();
+		}
+		if (!write_full(fd, response.data(), response.length()))
+			break;
+	}
+	close(fd);
+}
+/**
+ * @brief Waits for SIGINT/SIGTERM, then removes the daemon's socket, saves
+ * 			the result cache, prints the latency report if one was asked for
+ * 			and exits.
+ */
+void daemon_wait_for_shutdown(sigset_t signal_set,
+		const struct daemon_config_t *config) {
+	int sig;
+	while (sigwait(&signal_set, &sig) != 0)
+		;
+	unlink(config->socket_path.c_str());
+	if (config->cache != NULL) {
+		result_cache_save(config->cache);
+	}
+	if (latency_report_enabled) {
+		print_latency_report();
+	}
+	std::cout.flush();
+	_exit(EXIT_SUCCESS);
+}
+/**
+ * @brief Runs the parser as a daemon on a unix domain socket. Only returns
+ * 			if the socket can not be set up or accept() fails.
+ * @param config The daemon settings.
+ * @return false on error.
+ */
+bool run_daemon(const struct daemon_config_t *config) {
+	struct sockaddr_un addr;
+	struct daemon_queue_t queue;
+	int listen_fd;
+
+	if (config->socket_path.length() >= sizeof(addr.sun_path)) {
+		std::cerr << "Socket path too long: " << config->socket_path
+				<< std::endl;
+		return false;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, config->socket_path.c_str());
+
+	listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listen_fd < 0) {
+		std::cerr << "socket(): " << strerror(errno) << std::endl;
+		return false;
+	}
+	unlink(config->socket_path.c_str());
+	if (bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) != 0
+			or listen(listen_fd, SOMAXCONN) != 0) {
+		std::cerr << "Could not listen on " << config->socket_path << ": "
+				<< strerror(errno) << std::endl;
+		close(listen_fd);
+		return false;
+	}
+	//clients going away must not kill the daemon
+	signal(SIGPIPE, SIG_IGN);
+	/*
+	 * SIGINT/SIGTERM are handled by a thread of their own; every thread
+	 * started from here on inherits the blocked mask.
+	 */
+	sigset_t signal_set;
+	sigemptyset(&signal_set);
+	sigaddset(&signal_set, SIGINT);
+	sigaddset(&signal_set, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &signal_set, NULL);
+	std::thread(daemon_wait_for_shutdown, signal_set, config).detach();
+
+	queue.depth = config->queue_depth;
+	for (unsigned int i = 0; i < config->worker_count; i++) {
+		std::thread(daemon_worker, &queue, config).detach();
+	}
+	while (true) {
+		int fd = accept(listen_fd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR or errno == ECONNABORTED)
+				continue;
+			std::cerr << "accept(): " << strerror(errno) << std::endl;
+			close(listen_fd);
+			return false;
+		}
+		std::thread(daemon_serve_connection, fd, &queue, config).detach();
+	}
+}
+/**
+ * @brief A client for the daemon which measures round trip latency.
+ *
+ * Sends the queries read from stdin in batches of batch_size, rounds times
+ * over, and reports throughput along with latency percentiles per batch.
+ *
+ * @param socket_path The daemon's socket.
+ * @param batch_size Queries per request.
+ * @param rounds How many times the whole query set is sent.
+ * @return false on error.
+ */
+bool run_daemon_bench(std::string socket_path, unsigned int batch_size,
+		unsigned int rounds) {
+	struct sockaddr_un addr;
+	std::vector<std::string> query_list;
+	std::vector<double> latency_list;
+	std::string query, request, response;
+	uint32_t status, result_count, len;
+	size_t query_total = 0;
+	int fd;
+
+	while (getline(std::cin, query)) {
+		if (query != "")
+			query_list.push_back(query);
+	}
+	if (query_list.empty() or batch_size == 0) {
+		std::cerr << "No queries to send" << std::endl;
+		return false;
+	}
+	if (socket_path.length() >= sizeof(addr.sun_path)) {
+		std::cerr << "Socket path too long: " << socket_path << std::endl;
+		return false;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, socket_path.c_str());
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0 or connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+		std::cerr << "Could not connect to " << socket_path << ": "
+				<< strerror(errno) << std::endl;
+		return false;
+	}
+
+	std::chrono::steady_clock::time_point run_start =
+			std::chrono::steady_clock::now();
+	for (unsigned int r = 0; r < rounds; r++) {
+		for (size_t first = 0; first < query_list.size(); first += batch_size) {
+			size_t last = std::min(first + batch_size, query_list.size());
+			request.clear();
+			append_uint32(&request, last - first);
+			for (size_t i = first; i < last; i++) {
+				append_uint32(&request, query_list[i].length());
+				request.append(query_list[i]);
+			}
+
+			std::chrono::steady_clock::time_point start =
+					std::chrono::steady_clock::now();
+			if (!write_full(fd, request.data(), request.length())
+					or !read_full(fd, &status, sizeof(status))
+					or !read_full(fd, &result_count, sizeof(result_count))) {
+				std::cerr << "Lost connection to daemon" << std::endl;
+				close(fd);
+				return false;
+			}
+			if (status != DAEMON_OK) {
+				std::cerr << "Daemon refused batch, status " << status
+						<< std::endl;
+				close(fd);
+				return false;
+			}
+			for (uint32_t i = 0; i < result_count; i++) {
+				if (!read_full(fd, &len, sizeof(len))) {
+					close(fd);
+					return false;
+				}
+				response.resize(len);
+				if (len != 0 and !read_full(fd, &response[0], len)) {
+					close(fd);
+					return false;
+				}
+			}
+			latency_list.push_back(
+					std::chrono::duration<double, std::micro>(
+							std::chrono::steady_clock::now() - start).count());
+			query_total += last - first;
+		}
+	}
+	double elapsed = std::chrono::duration<double>(
+			std::chrono::steady_clock::now() - run_start).count();
+	close(fd);
+
+	std::sort(latency_list.begin(), latency_list.end());
+	const double percentiles[] = { 50, 90, 99, 99.9 };
+	std::cout << "Batches: " << latency_list.size() << " Queries: "
+			<< query_total << " Queries/s: " << (query_total / elapsed)
+			<< std::endl;
+	std::cout << "Batch round trip (us):";
+	for (unsigned int i = 0; i < 4; i++) {
+		size_t rank = (size_t) (percentiles[i] / 100 * (latency_list.size() - 1));
+		std::cout << " p" << percentiles[i] << "=" << latency_list[rank];
+	}
+	std::cout << " max=" << latency_list.back() << std::endl;
+	return true;
+}
+/*
+ * ===================== sampling mode =====================
+ *
+ * For streams too large to parse in full, --sample=N parses one query in N
+ * and prints estimated access counts per table and column instead of the
+ * per query results. Queries are split into strata: a single one by default,
+ * or one per query digest with --sample-by-digest so that every query shape
+ * has its first occurrence, and every Nth after it, parsed. Within a stratum
+ * of n queries of which k were parsed and h touched a name, the name is
+ * estimated at n * h / k with variance n^2 (1 - k/n) p (1 - p) / k, p = h/k.
+ * Strata estimates add up.
+ *
+ * A token bucket can additionally cap the time spent parsing per second of
+ * wall time; queries picked while the bucket is empty are skipped.
+ */
+struct sample_stratum_t {
+	uint64_t seen_count;
+	uint64_t parsed_count;
+	std::map<std::string, uint64_t> tbl_hit_map;
+	std::map<std::string, uint64_t> tblcol_hit_map;
+};
+struct sampler_t {
+	unsigned int rate; // parse 1 in rate queries of a stratum
+	bool by_digest;
+	uint64_t digest_seed;
+	std::unordered_map<uint64_t, struct sample_stratum_t> stratum_map;
+	// token bucket, in nanoseconds of parse time. budget 0 means unlimited
+	double budget_ns_per_sec;
+	double bucket_ns;
+	std::chrono::steady_clock::time_point last_refill;
+	uint64_t throttled_count;
+};
+
+/**
+ * @brief Initialises a sampler.
+ * @param sampler The sampler.
+ * @param rate Parse one query in rate.
+ * @param by_digest Sample within each query shape rather than the stream.
+ * @param digest_seed Seed for compute_query_digest().
+ * @param cpu_ms_per_sec Milliseconds of parsing allowed per second, 0 for
+ * 			no limit.
+ */
+void sampler_init(struct sampler_t *sampler, unsigned int rate, bool by_digest,
+		uint64_t digest_seed, unsigned int cpu_ms_per_sec) {
+	sampler->rate = rate;
+	sampler->by_digest = by_digest;
+	sampler->digest_seed = digest_seed;
+	sampler->stratum_map.clear();
+	sampler->budget_ns_per_sec = cpu_ms_per_sec * 1e6;
+	sampler->bucket_ns = sampler->budget_ns_per_sec;
+	sampler->last_refill = std::chrono::steady_clock::now();
+	sampler->throttled_count = 0;
+}
+/**
+ * @brief Decides whether a query is to be parsed.
+ *
+ * A skipped query costs a counter update, plus a digest scan in
+ * --sample-by-digest mode. It is never tokenized.
+ *
+ * @param sampler The sampler.
+ * @param query The query read from input.
+ * @param stratum Receives the stratum the query belongs to.
+ * @return true if the query is to be parsed and then passed to
+ * 			sampler_record().
+ */
+bool sampler_select(struct sampler_t *sampler, std::string &query,
+		struct sample_stratum_t **stratum) {
+	uint64_t key = 0;
+	if (sampler->by_digest)
+		key = compute_query_digest(query, sampler->digest_seed);
+
+	*stratum = &sampler->stratum_map[key];
+	if ((*stratum)->seen_count++ % sampler->rate != 0)
+		return false;
+
+	if (sampler->budget_ns_per_sec != 0) {
+		std::chrono::steady_clock::time_point now =
+				std::chrono::steady_clock::now();
+		sampler->bucket_ns = std::min(sampler->budget_ns_per_sec,
+				sampler->bucket_ns
+						+ sampler->budget_ns_per_sec
+								* std::chrono::duration<double>(
+										now - sampler->last_refill).count());
+		sampler->last_refill = now;
+		if (sampler->bucket_ns <= 0) {
+			sampler->throttled_count++;
+			return false;
+		}
+	}
+	return true;
+}
+/**
+ * @brief Adds the result of a parsed query to its stratum.
+ * @param sampler The sampler.
+ * @param stratum As returned by sampler_select().
+ * @param res The parse result.
+ * @param parse_ns Time the parse took, charged to the token bucket.
+ */
+void sampler_record(struct sampler_t *sampler,
+		struct sample_stratum_t *stratum, struct TblColList *res,
+		double parse_ns) {
+	stratum->parsed_count++;
+	for (std::list<std::string>::iterator it = res->mTblNameList.begin();
+			it != res->mTblNameList.end(); it++) {
+		stratum->tbl_hit_map[*it]++;
+	}
+	for (std::list<std::string>::iterator it = res->mTblColNameList.begin();
+			it != res->mTblColNameList.end(); it++) {
+		stratum->tblcol_hit_map[*it]++;
+	}
+	sampler->bucket_ns -= parse_ns;
+}
+/**
+ * @brief Scales the hits of one stratum up and adds them to the totals.
+ * @param n Queries seen in the stratum.
+ * @param k Queries parsed in the stratum.
+ * @param hit_map Per name number of parsed queries that touched it.
+ * @param estimate_map Per name estimate and variance, to be added to.
+ */
+void sampler_add_estimates(uint64_t n, uint64_t k,
+		std::map<std::string, uint64_t> &hit_map,
+		std::map<std::string, std::pair<double, double> > &estimate_map) {
+	for (std::map<std::string, uint64_t>::iterator it = hit_map.begin();
+			it != hit_map.end(); it++) {
+		double p = (double) it->second / k;
+		estimate_map[it->first].first += n * p;
+		estimate_map[it->first].second += (double) n * n * (1 - (double) k / n)
+				* p * (1 - p) / k;
+	}
+}
+/**
+ * @brief Prints estimates, largest first, as [name] estimate +- std. error.
+ */
+void print_estimates(std::string title,
+		std::map<std::string, std::pair<double, double> > &estimate_map) {
+	std::vector<std::pair<double, std::string> > order;
+	for (std::map<std::string, std::pair<double, double> >::iterator it =
+			estimate_map.begin(); it != estimate_map.end(); it++) {
+		order.push_back(std::make_pair(-it->second.first, it->first));
+	}
+	std::sort(order.begin(), order.end());
+
+	std::cout << title << std::endl;
+	for (size_t i = 0; i < order.size(); i++) {
+		std::pair<double, double> &estimate = estimate_map[order[i].second];
+		std::cout << "[" << order[i].second << "] " << (uint64_t) (estimate.first
+				+ 0.5) << " +- " << sqrt(estimate.second) << std::endl;
+	}
+}
+/**
+ * @brief Prints the estimated table and column access counts.
+ */
+void print_sample_report(struct sampler_t *sampler) {
+	std::map<std::string, std::pair<double, double> > tbl_estimate_map,
+			tblcol_estimate_map;
+	uint64_t seen = 0, parsed = 0, unrepresented = 0;
+
+	for (std::unordered_map<uint64_t, struct sample_stratum_t>::iterator it =
+			sampler->stratum_map.begin(); it != sampler->stratum_map.end();
+			it++) {
+		struct sample_stratum_t *stratum = &it->second;
+		seen += stratum->seen_count;
+		parsed += stratum->parsed_count;
+		if (stratum->parsed_count == 0) {
+			unrepresented += stratum->seen_count;
+			continue;
+		}
+		sampler_add_estimates(stratum->seen_count, stratum->parsed_count,
+				stratum->tbl_hit_map, tbl_estimate_map);
+		sampler_add_estimates(stratum->seen_count, stratum->parsed_count,
+				stratum->tblcol_hit_map, tblcol_estimate_map);
+	}
+
+	std::cout << "Sampled " << parsed << " of " << seen << " queries in "
+			<< sampler->stratum_map.size() << " strata, "
+			<< sampler->throttled_count << " skipped by the CPU budget, "
+			<< unrepresented << " in strata never parsed" << std::endl;
+	print_estimates("Estimated table accesses:", tbl_estimate_map);
+	print_estimates("Estimated table_name with col_name accesses:",
+			tblcol_estimate_map);
+}
+/**
+ * @brief Splits a comma separated option value into its elements.
+ * @param value The option value, for e.g. "t1.id,t2.user_id".
+ * @param mylist The list to which the elements will be appended.
+ */
+void split_option_list(std::string value, std::list<std::string> &mylist) {
+	std::string::size_type start = 0, end;
+	while (start <= value.length()) {
+		end = value.find(',', start);
+		if (end == std::string::npos)
+			end = value.length();
+		if (end > start)
+			mylist.push_back(value.substr(start, end - start));
+		start = end + 1;
+	}
+}
+int main(int argc, char *argv[]) {
+	std::string query;
+	struct TblColList *res = NULL;
+	struct parse_options_t opts;
+	struct parse_options_t *popts = NULL;
+	struct result_cache_t cache;
+	std::string cache_path = "";
+	struct daemon_config_t daemon_config;
+	struct schema_catalog_t catalog;
+	struct table_watchlist_t watchlist;
+	std::string bench_socket_path = "";
+	unsigned int bench_batch_size = 100, bench_rounds = 100;
+	struct sampler_t sampler;
+	struct sample_stratum_t *stratum = NULL;
+	unsigned int sample_rate = 0, sample_cpu_ms = 0;
+	bool sample_by_digest = false;
+	uint64_t digest_seed;
+	std::chrono::steady_clock::time_point parse_start;
+
+	opts.stop_when_shard_keys_found = false;
+	opts.report_literal_lists = false;
+	opts.parallel_min_length = 0;
+	opts.parallel_threads = std::thread::hardware_concurrency();
+	opts.catalog = NULL;
+	opts.watchlist = NULL;
+	daemon_config.socket_path = "";
+	daemon_config.worker_count = std::max(1u,
+			std::thread::hardware_concurrency());
+	daemon_config.max_batch_size = 1024;
+	daemon_config.queue_depth = 64;
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		if (arg.compare(0, 13, "--shard-keys=") == 0) {
+			split_option_list(convert_to_uppercase(arg.substr(13)),
+					opts.shard_key_list);
+			popts = &opts;
+		} else if (arg == "--shard-keys-only") {
+			opts.stop_when_shard_keys_found = true;
+		} else if (arg == "--literal-list-sizes") {
+			opts.report_literal_lists = true;
+			popts = &opts;
+		} else if (arg.compare(0, 22, "--parallel-min-length=") == 0) {
+			opts.parallel_min_length = strtoul(arg.c_str() + 22, NULL, 10);
+			popts = &opts;
+		} else if (arg.compare(0, 19, "--parallel-threads=") == 0) {
+			opts.parallel_threads = strtoul(arg.c_str() + 19, NULL, 10);
+		} else if (arg.compare(0, 9, "--schema=") == 0) {
+			if (!load_schema_catalog(arg.substr(9), &catalog)) {
+				std::cerr << "Could not read schema file: " << arg.substr(9)
+						<< std::endl;
+				exit(EXIT_FAILURE);
+			}
+			opts.catalog = &catalog;
+			popts = &opts;
+		} else if (arg.compare(0, 12, "--watchlist=") == 0) {
+			if (!load_table_watchlist(arg.substr(12), &watchlist)) {
+				std::cerr << "Could not read watchlist file: " << arg.substr(12)
+						<< std::endl;
+				exit(EXIT_FAILURE);
+			}
+			opts.watchlist = &watchlist;
+			popts = &opts;
+		} else if (arg == "--latency-report") {
+			enable_latency_report(10);
+		} else if (arg.compare(0, 17, "--latency-report=") == 0) {
+			enable_latency_report(strtoul(arg.c_str() + 17, NULL, 10));
+		} else if (arg.compare(0, 9, "--daemon=") == 0) {
+			daemon_config.socket_path = arg.substr(9);
+		} else if (arg.compare(0, 17, "--daemon-workers=") == 0) {
+			daemon_config.worker_count = strtoul(arg.c_str() + 17, NULL, 10);
+		} else if (arg.compare(0, 19, "--daemon-max-batch=") == 0) {
+			daemon_config.max_batch_size = strtoul(arg.c_str() + 19, NULL, 10);
+		} else if (arg.compare(0, 21, "--daemon-queue-depth=") == 0) {
+			daemon_config.queue_depth = strtoul(arg.c_str() + 21, NULL, 10);
+		} else if (arg.compare(0, 15, "--daemon-bench=") == 0) {
+			bench_socket_path = arg.substr(15);
+		} else if (arg.compare(0, 21, "--daemon-bench-batch=") == 0) {
+			bench_batch_size = strtoul(arg.c_str() + 21, NULL, 10);
+		} else if (arg.compare(0, 22, "--daemon-bench-rounds=") == 0) {
+			bench_rounds = strtoul(arg.c_str() + 22, NULL, 10);
+		} else if (arg.compare(0, 9, "--sample=") == 0) {
+			sample_rate = strtoul(arg.c_str() + 9, NULL, 10);
+		} else if (arg == "--sample-by-digest") {
+			sample_by_digest = true;
+		} else if (arg.compare(0, 16, "--sample-cpu-ms=") == 0) {
+			sample_cpu_ms = strtoul(arg.c_str() + 16, NULL, 10);
+		} else if (arg.compare(0, 15, "--result-cache=") == 0) {
+			cache_path = arg.substr(15);
+		} else {
+			std::cerr << "Unknown option: " << arg << std::endl;
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	/*
+	 * cached results only hold table and column names, literal dependent
+	 * results can not come out of the cache.
+	 */
+	if (cache_path != ""
+			and (!opts.shard_key_list.empty() or opts.report_literal_lists
+					or opts.watchlist != NULL)) {
+		std::cerr << "--result-cache can not be combined with --shard-keys,"
+				" --literal-list-sizes or --watchlist" << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	if (bench_socket_path != "") {
+		exit(run_daemon_bench(bench_socket_path, bench_batch_size,
+				bench_rounds) ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
+	digest_seed = (opts.catalog != NULL) ?
+			opts.catalog->fingerprint : 14695981039346656037ULL;
+	if (cache_path != "") {
+		result_cache_open(&cache, cache_path);
+	}
+	if (daemon_config.socket_path != "") {
+		/*
+		 * the sampler is run by the stdin loop below, which a daemon never
+		 * gets to.
+		 */
+		if (sample_rate != 0 or sample_by_digest or sample_cpu_ms != 0) {
+			std::cerr << "--daemon can not be combined with --sample*"
+					<< std::endl;
+			exit(EXIT_FAILURE);
+		}
+		if (daemon_config.worker_count == 0 or daemon_config.queue_depth == 0) {
+			std::cerr << "--daemon-workers and --daemon-queue-depth must be"
+					" at least 1" << std::endl;
+			exit(EXIT_FAILURE);
+		}
+		daemon_config.opts = &opts;
+		daemon_config.cache = (cache_path != "") ? &cache : NULL;
+		daemon_config.digest_seed = digest_seed;
+		run_daemon(&daemon_config);
+		exit(EXIT_FAILURE);
+	}
+	if (cache_path != "") {
+		sigset_t signal_set;
+		sigemptyset(&signal_set);
+		sigaddset(&signal_set, SIGINT);
+		sigaddset(&signal_set, SIGTERM);
+		pthread_sigmask(SIG_BLOCK, &signal_set, NULL);
+		std::thread(result_cache_wait_for_shutdown, signal_set, &cache)
+				.detach();
+	}
+	if ((sample_by_digest or sample_cpu_ms != 0) and sample_rate == 0) {
+		sample_rate = 1;
+	}
+	if (sample_rate != 0) {
+		sampler_init(&sampler, sample_rate, sample_by_digest, digest_seed,
+				sample_cpu_ms);
+	}
+
+	while (!std::cin.eof()) {
+		getline(std::cin, query);
+		if (query == "")
+			continue;
+		if (sample_rate != 0) {
+			if (!sampler_select(&sampler, query, &stratum))
+				continue;
+			parse_start = std::chrono::steady_clock::now();
+		} else {
+			std::cout << "Parsing query: " << query << "\n" << std::endl;
+		}
+		if (cache_path != "") {
+			uint64_t digest = compute_query_digest(query, digest_seed);
+			res = result_cache_lookup(&cache, digest);
+			if (res == NULL) {
+				res = ProcessQuery(query, popts);
+				result_cache_add(&cache, digest, res);
+			}
+		} else {
+			res = ProcessQuery(query, popts);
+		}
+		if (sample_rate != 0) {
+			sampler_record(&sampler, stratum, res,
+					std::chrono::duration<double, std::nano>(
+							std::chrono::steady_clock::now() - parse_start)
+							.count());
+		} else {
+			print_final_result(res);
+			std::cout << std::endl;
+		}
+		delete res;
+	}
+	if (sample_rate != 0) {
+		print_sample_report(&sampler);
+	}
+	if (cache_path != "") {
+		result_cache_save(&cache);
+		result_cache_close(&cache);
+	}
+	if (latency_report_enabled) {
+		print_latency_report();
 	}
 	exit(EXIT_SUCCESS);
 }